@@ -17,6 +17,8 @@ uint64_t GC_CAN_QUIT	= 0;
 uint64_t GC_BUSY		= 1;
 uint64_t GC_QUIT		= 2;
 uint64_t gc_alive		= GC_CAN_QUIT;
+/* G/C threads still running, pmwcas_finish waits for them */
+std::atomic<int> gc_running(0);
 
 /* set desc status to FREE */
 void pmwcas_first_use(mdesc_pool_t pool, PMEMobjpool * pop, PMEMoid oid)
@@ -60,6 +62,7 @@ int pmwcas_init(mdesc_pool_t pool, PMEMoid oid, PMEMobjpool * pop)
 	/* GC߳ */
 	gc_alive = GC_CAN_QUIT;
 	for (int i = 0; i < GC_THREADS_COUNT; ++i) {
+		++gc_running;
 		std::thread gc([pool] {
 			uint64_t gc_rd;
 			while (true) {
@@ -73,6 +76,7 @@ int pmwcas_init(mdesc_pool_t pool, PMEMoid oid, PMEMobjpool * pop)
 				CAS(&gc_alive, GC_CAN_QUIT, GC_BUSY);
 				std::this_thread::sleep_for(std::chrono::milliseconds(GC_WAIT_MS));
 			}
+			--gc_running;
 		});
 		gc.detach();
 	}
@@ -82,6 +86,9 @@ int pmwcas_init(mdesc_pool_t pool, PMEMoid oid, PMEMobjpool * pop)
 void pmwcas_finish(mdesc_pool_t pool)
 {
 	while (GC_QUIT != CAS(&gc_alive, GC_QUIT, GC_CAN_QUIT));
+	/* a late thread would run on the next pool's gc_alive */
+	while (gc_running)
+		std::this_thread::yield();
 	gc_full(pool->gc, 50);
 	gc_destroy(pool->gc);
 	pool->gc = nullptr;
@@ -0,0 +1,366 @@
+#ifndef BZCODEC_H
+#define BZCODEC_H
+
+#include <stdint.h>
+#include <string.h>
+#include <ostream>
+#include <iomanip>
+#include <type_traits>
+#include <string>
+
+/*
+* Key and value codecs, picked at compile time from the stored type:
+* integral types:	fixed-width integer, native order
+* char:				variable-length bytes, NUL-terminated, strcmp order
+* bz_bytes:			variable-length binary, length-prefixed, memcmp order
+* anything else:	fixed-width binary, memcmp order (big-endian encoded keys)
+* Each codec gives the byte size of an item, its copy and compare, an
+* 8-byte order-preserving prefix, a hash for the leaf fingerprints and
+* the BZ_KEY_MAX check.
+*/
+
+/* the key of the rightmost separator, stored as 8 bytes whatever the key type */
+const uint64_t BZ_KEY_MAX = 0xdeadbeafdeadbeaf;
+
+/* @param key has at least 8 readable bytes (keys are padded for this check) */
+inline bool bz_is_key_max(const void * key) {
+	uint64_t k;
+	memcpy(&k, key, sizeof(k));
+	return k == BZ_KEY_MAX;
+}
+inline void bz_set_key_max(void * key) {
+	memcpy(key, &BZ_KEY_MAX, sizeof(BZ_KEY_MAX));
+}
+
+/* big-endian load of the first @param n <= 8 bytes, zero filled */
+inline uint64_t bz_load_be(const uint8_t * s, uint32_t n) {
+	uint64_t p = 0;
+	for (uint32_t i = 0; i < n; ++i)
+		p |= (uint64_t)s[i] << (56 - 8 * i);
+	return p;
+}
+
+/* FNV-1a */
+inline uint64_t bz_hash_bytes(const uint8_t * s, uint32_t n) {
+	uint64_t h = 14695981039346656037ULL;
+	for (uint32_t i = 0; i < n; ++i)
+		h = (h ^ s[i]) * 1099511628211ULL;
+	return h;
+}
+
+/* codecs whose keys are padded to 8 bytes for the sentinel check */
+struct bz_padded_max
+{
+	static bool is_max(const void * key) {
+		return bz_is_key_max(key);
+	}
+};
+
+template<typename T>
+struct bz_int_codec : bz_padded_max
+{
+	static uint32_t size(const T *) {
+		return sizeof(T);
+	}
+	static void copy(T * dst, const T * src) {
+		*dst = *src;
+	}
+	static int compare(const T * a, const T * b) {
+		return (*a > *b) - (*a < *b);
+	}
+	static uint64_t prefix(const T * key) {
+		if (std::is_signed<T>::value)
+			return (uint64_t)(int64_t)*key ^ ((uint64_t)1 << 63);
+		return (uint64_t)*key;
+	}
+	static uint64_t hash(const T * key) {
+		return (uint64_t)*key * 0x9e3779b97f4a7c15ULL;
+	}
+	static void print(std::ostream & os, const T * key) {
+		os << *key;
+	}
+};
+
+template<typename T>
+struct bz_binary_codec : bz_padded_max
+{
+	static uint32_t size(const T *) {
+		return sizeof(T);
+	}
+	static void copy(T * dst, const T * src) {
+		memcpy((void*)dst, (const void*)src, sizeof(T));
+	}
+	static int compare(const T * a, const T * b) {
+		int c = memcmp((const void*)a, (const void*)b, sizeof(T));
+		return (c > 0) - (c < 0);
+	}
+	static uint64_t prefix(const T * key) {
+		return bz_load_be((const uint8_t*)key, sizeof(T) < 8 ? (uint32_t)sizeof(T) : 8);
+	}
+	static uint64_t hash(const T * key) {
+		return bz_hash_bytes((const uint8_t*)key, sizeof(T));
+	}
+	static void print(std::ostream & os, const T * key) {
+		const uint8_t * s = (const uint8_t*)key;
+		std::ios_base::fmtflags f = os.flags();
+		for (uint32_t i = 0; i < sizeof(T); ++i)
+			os << std::hex << std::setw(2) << std::setfill('0') << (uint32_t)s[i];
+		os.flags(f);
+	}
+};
+
+struct bz_cstr_codec : bz_padded_max
+{
+	static uint32_t size(const char * key) {
+		return (uint32_t)strlen(key) + 1;
+	}
+	static void copy(char * dst, const char * src) {
+		memcpy(dst, src, size(src));
+	}
+	static int compare(const char * a, const char * b) {
+		return strcmp(a, b);
+	}
+	/* zero past the terminator */
+	static uint64_t prefix(const char * key) {
+		const uint8_t * s = (const uint8_t*)key;
+		uint32_t n = 0;
+		while (n < 8 && s[n])
+			++n;
+		return bz_load_be(s, n);
+	}
+	static uint64_t hash(const char * key) {
+		return bz_hash_bytes((const uint8_t*)key, size(key) - 1);
+	}
+	static void print(std::ostream & os, const char * key) {
+		os << key;
+	}
+};
+
+template<typename T, typename = void>
+struct bz_codec : bz_binary_codec<T> {};
+
+template<typename T>
+struct bz_codec<T, typename std::enable_if<std::is_integral<T>::value>::type> : bz_int_codec<T> {};
+
+template<>
+struct bz_codec<char> : bz_cstr_codec {};
+
+/*
+* Variable-length binary item, zeros allowed: a 4-byte length followed by
+* the bytes. The tree stores it as is, so key_size (or the value size) of
+* a record is bz_bytes::size_of(length). Build one in a caller buffer:
+*	char buf[64];
+*	const bz_bytes * k = bz_bytes::make(buf, src, n);
+*	tree.insert(k, v, k->size(), k->size() + val_sz);
+*/
+struct bz_bytes
+{
+	/* unaligned inside a node: read and written through memcpy */
+	uint8_t len_[sizeof(uint32_t)];
+
+	static uint32_t size_of(uint32_t n) {
+		return (uint32_t)sizeof(uint32_t) + n;
+	}
+	static bz_bytes * make(void * buf, const void * src, uint32_t n) {
+		memcpy(buf, &n, sizeof(n));
+		memcpy((uint8_t*)buf + sizeof(n), src, n);
+		return (bz_bytes*)buf;
+	}
+	uint32_t length() const {
+		uint32_t n;
+		memcpy(&n, len_, sizeof(n));
+		return n;
+	}
+	uint32_t size() const {
+		return size_of(length());
+	}
+	const uint8_t * data() const {
+		return len_ + sizeof(uint32_t);
+	}
+};
+
+/*
+* length-aware memcmp order: a proper prefix sorts first.
+* The length word tells BZ_KEY_MAX apart, no real length reaches its low
+* half, so a short key is never read past its end
+*/
+struct bz_bytes_codec
+{
+	static uint32_t size(const bz_bytes * key) {
+		return key->size();
+	}
+	static void copy(bz_bytes * dst, const bz_bytes * src) {
+		memcpy((void*)dst, (const void*)src, src->size());
+	}
+	static int compare(const bz_bytes * a, const bz_bytes * b) {
+		uint32_t la = a->length(), lb = b->length();
+		int c = memcmp(a->data(), b->data(), la < lb ? la : lb);
+		if (c)
+			return c < 0 ? -1 : 1;
+		return (la > lb) - (la < lb);
+	}
+	static uint64_t prefix(const bz_bytes * key) {
+		uint32_t n = key->length();
+		return bz_load_be(key->data(), n < 8 ? n : 8);
+	}
+	static uint64_t hash(const bz_bytes * key) {
+		return bz_hash_bytes(key->data(), key->length());
+	}
+	static bool is_max(const void * key) {
+		return ((const bz_bytes*)key)->length() == (uint32_t)BZ_KEY_MAX;
+	}
+	static void print(std::ostream & os, const bz_bytes * key) {
+		std::ios_base::fmtflags f = os.flags();
+		for (uint32_t i = 0; i < key->length(); ++i)
+			os << std::hex << std::setw(2) << std::setfill('0') << (uint32_t)key->data()[i];
+		os.flags(f);
+	}
+};
+
+template<>
+struct bz_codec<bz_bytes> : bz_bytes_codec {};
+
+/*
+* A key split in two: @param pfx[0, p) then @param sfx[0, n), the common
+* prefix of a compressed leaf and the stored rest of the key (p == 0 for a
+* key stored in full). Compared and copied as the joined bytes
+*/
+struct bz_split_key
+{
+	const uint8_t * pfx;
+	uint32_t p;
+	const uint8_t * sfx;
+	uint32_t n;
+
+	uint32_t size() const {
+		return p + n;
+	}
+	uint8_t at(uint32_t i) const {
+		return i < p ? pfx[i] : sfx[i - p];
+	}
+	/* the first @param m bytes */
+	bz_split_key head(uint32_t m) const {
+		if (m <= p)
+			return bz_split_key{ pfx, m, sfx, 0 };
+		return bz_split_key{ pfx, p, sfx, m - p };
+	}
+	/*
+	* shortest S with *this <= S < @param hi, for *this < hi: *this, or the first
+	* lcp + 1 bytes of hi when shorter than hi; @return its length, @param from_hi which one
+	*/
+	uint32_t separator(const bz_split_key & hi, bool & from_hi) const {
+		uint32_t m = size() < hi.size() ? size() : hi.size(), l = 0;
+		while (l < m && at(l) == hi.at(l))
+			++l;
+		from_hi = l < size() && l + 1 < hi.size();
+		return from_hi ? l + 1 : size();
+	}
+	/* common prefix length with @param other[0, @param len) */
+	uint32_t lcp(const uint8_t * other, uint32_t len) const {
+		uint32_t m = len < size() ? len : size(), i = 0;
+		for (; i < m && i < p; ++i)
+			if (pfx[i] != other[i])
+				return i;
+		for (; i < m; ++i)
+			if (sfx[i - p] != other[i])
+				return i;
+		return m;
+	}
+	/* bytes [@param cut, size()) to @param dst */
+	void copy(uint8_t * dst, uint32_t cut) const {
+		if (cut < p) {
+			memcpy(dst, pfx + cut, p - cut);
+			memcpy(dst + p - cut, sfx, n);
+		}
+		else {
+			memcpy(dst, sfx + cut - p, n - (cut - p));
+		}
+	}
+	/* order of @param key[0, @param len) against the joined bytes, a proper prefix first */
+	int compare(const uint8_t * key, uint32_t len) const {
+		int c = memcmp(key, pfx, len < p ? len : p);
+		if (c)
+			return c < 0 ? -1 : 1;
+		if (len < p)
+			return -1;
+		uint32_t rest = len - p;
+		c = memcmp(key + p, sfx, rest < n ? rest : n);
+		if (c)
+			return c < 0 ? -1 : 1;
+		return (rest > n) - (rest < n);
+	}
+};
+
+/*
+* Leaf key compression: the keys of a consolidated leaf that share the
+* node's common prefix are stored without it, still in the codec format.
+* Only for the variable-length byte codecs, where the order of the joined
+* bytes is the key order; disabled for every other type.
+* split:	the key @param sfx of a node with prefix @param pfx[0, @param p)
+* restrip:	write that key without its first @param cut bytes, @return its size
+* separator:	write the shortest key S, @param lo <= S < @param hi, @return its size
+*/
+template<typename T>
+struct bz_prefix_codec
+{
+	static const bool enabled = false;
+	static bz_split_key split(const uint8_t * pfx, uint32_t p, const T *) {
+		return bz_split_key{ pfx, p, nullptr, 0 };
+	}
+	static uint32_t restrip(T *, const bz_split_key &, uint32_t) {
+		return 0;
+	}
+	static int compare(const T *, const bz_split_key &) {
+		return 0;
+	}
+	static uint32_t separator(T *, const bz_split_key &, const bz_split_key &) {
+		return 0;
+	}
+};
+
+template<>
+struct bz_prefix_codec<char>
+{
+	static const bool enabled = true;
+	static bz_split_key split(const uint8_t * pfx, uint32_t p, const char * sfx) {
+		return bz_split_key{ pfx, p, (const uint8_t*)sfx, (uint32_t)strlen(sfx) };
+	}
+	static uint32_t restrip(char * dst, const bz_split_key & k, uint32_t cut) {
+		k.copy((uint8_t*)dst, cut);
+		dst[k.size() - cut] = 0;
+		return k.size() - cut + 1;
+	}
+	static int compare(const char * key, const bz_split_key & k) {
+		return k.compare((const uint8_t*)key, (uint32_t)strlen(key));
+	}
+	static uint32_t separator(char * dst, const bz_split_key & lo, const bz_split_key & hi) {
+		bool from_hi;
+		uint32_t m = lo.separator(hi, from_hi);
+		return restrip(dst, (from_hi ? hi : lo).head(m), 0);
+	}
+};
+
+template<>
+struct bz_prefix_codec<bz_bytes>
+{
+	static const bool enabled = true;
+	static bz_split_key split(const uint8_t * pfx, uint32_t p, const bz_bytes * sfx) {
+		return bz_split_key{ pfx, p, sfx->data(), sfx->length() };
+	}
+	static uint32_t restrip(bz_bytes * dst, const bz_split_key & k, uint32_t cut) {
+		uint32_t n = k.size() - cut;
+		memcpy(dst->len_, &n, sizeof(n));
+		k.copy(dst->len_ + sizeof(n), cut);
+		return bz_bytes::size_of(n);
+	}
+	static int compare(const bz_bytes * key, const bz_split_key & k) {
+		return k.compare(key->data(), key->length());
+	}
+	static uint32_t separator(bz_bytes * dst, const bz_split_key & lo, const bz_split_key & hi) {
+		bool from_hi;
+		uint32_t m = lo.separator(hi, from_hi);
+		return restrip(dst, (from_hi ? hi : lo).head(m), 0);
+	}
+};
+
+#endif // !BZCODEC_H
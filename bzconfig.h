@@ -9,10 +9,32 @@
 
 #define DESCRIPTOR_POOL_SIZE	4096
 #define WORD_DESCRIPTOR_SIZE	10
+/* leaves unlinked per PMwCAS by remove_range: 2 words each, 4 for the parent swap */
+#define RANGE_UNLINK_BATCH		((WORD_DESCRIPTOR_SIZE - 4) / 2)
 
 #define GC_THREADS_COUNT		10
 #define GC_WAIT_MS				10
 
+/* atomic_write: PMwCAS attempts on its reserved records, longest back-off between rounds */
+#define ATOMIC_PUBLISH_TRIES	8
+#define RETRY_MAX_MS			16
+
+#define REBUILD_THREADS_COUNT	8
+#define BULK_LOAD_FILL			0.8f
+/*
+* update 8-byte values in place with PMwCAS, they are read with pmwcas_read:
+* every such value must keep its top 3 (PMwCAS control) bits clear
+*/
+//#define BZ_INPLACE_VALUE
+/* scan the unsorted meta words with the scalar loop only, no AVX2/AVX-512 kernel */
+//#define BZ_NO_SIMD
+/* no key prefix array for the sorted region, binary search reads every probed key */
+//#define BZ_NO_KEY_PREFIX
+/* store the keys of consolidated leaves in full, no per-node common prefix (char / bz_bytes keys) */
+//#define BZ_NO_KEY_COMPRESSION
+/* a leaf split posts the last left key in full, not the shortest key that separates the halves */
+//#define BZ_NO_SEPARATOR_TRUNCATION
+
 #ifdef BZ_TEST
 //ݸʽΪ<Key = uint64_t, Val = rel_ptr<uint64_t>>
 #define NODE_MIN_FREE_SIZE		sizeof(uint64_t) * 3 * 1		// <= 1 consolidate
@@ -20,6 +42,7 @@
 #define NODE_SPLIT_SIZE			sizeof(uint64_t) * 2 * 6		// 6 split 
 #define NODE_MERGE_SIZE			sizeof(uint64_t) * 3 * 3 - 1	// < 3 merge
 #define NODE_ALLOC_SIZE			sizeof(uint64_t) * 3 * 7		// max 6
+#define NODE_FINGERPRINTS		4u								// unsorted slots with a fingerprint
 
 #else
 
@@ -28,6 +51,7 @@
 #define NODE_SPLIT_SIZE			4096
 #define NODE_MERGE_SIZE			2048
 #define NODE_ALLOC_SIZE			5120
+#define NODE_FINGERPRINTS		128u
 
 #endif // BZ_DEBUG
 
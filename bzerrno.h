@@ -12,4 +12,8 @@ const int ERACE = 9;
 const int ESMO = 10;
 const int ENONEED = 11;
 const int ECORRUPT = 12;
+const int EUNSORTED = 13;
+const int EMISMATCH = 14;
+const int EVALUE = 15;
+const int EBATCHSIZE = 16;
 #endif // !BZERRORNO_H
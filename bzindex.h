@@ -0,0 +1,169 @@
+#ifndef BZINDEX_H
+#define BZINDEX_H
+
+#include <map>
+#include <unordered_map>
+#include <string>
+#include <vector>
+#include <shared_mutex>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+
+/*
+* Volatile (DRAM) routing index for the hybrid mode.
+* Maps the fence key of every leaf (the separator of the leaf in its parent,
+* i.e. the inclusive upper bound of the keys it holds) to the leaf itself,
+* so point operations jump straight to the leaf instead of walking the
+* persistent inner nodes with pmwcas_read.
+* The index is never persisted: it is rebuilt from the leaves on recovery
+* and kept in sync by the leaf SMOs. An SMO holds lock_smo() across its
+* PMwCAS commit and the index update, so a reader (inside its epoch) finds
+* either the old leaves, not yet reclaimable, or the new ones, and the
+* updates land in commit order.
+* An update that misses its old leaf means the index lost track: it is
+* dropped (find() returns 0) and stale() asks for a rebuild.
+*/
+template<typename Key, typename KeyCmp>
+struct bz_dram_index
+{
+	struct fence_less
+	{
+		typedef void is_transparent;
+		bool operator()(const std::string & a, const std::string & b) const {
+			return KeyCmp()((const Key*)a.data(), (const Key*)b.data()) < 0;
+		}
+		bool operator()(const std::string & a, const Key * b) const {
+			return KeyCmp()((const Key*)a.data(), b) < 0;
+		}
+		bool operator()(const Key * a, const std::string & b) const {
+			return KeyCmp()(a, (const Key*)b.data()) < 0;
+		}
+	};
+	typedef std::vector<std::pair<std::string, uint64_t>> leaf_list;
+
+	/* fence key -> leaf */
+	std::map<std::string, uint64_t, fence_less> leaves_;
+	/* leaf -> fence key */
+	std::unordered_map<uint64_t, std::string> fences_;
+	std::shared_timed_mutex lock_;
+	bool ready_ = false;
+	std::atomic<bool> stale_{ false };
+
+	/* fences are padded to 8 bytes so that BZ_KEY_MAX checks never read past them */
+	static std::string make_fence(const Key * key, uint32_t key_sz) {
+		std::string fence((const char*)key, key_sz);
+		if (fence.size() < sizeof(uint64_t))
+			fence.resize(sizeof(uint64_t), 0);
+		return fence;
+	}
+
+	/* leaf covering @param key, 0 if the index is not usable */
+	uint64_t find(const Key * key) {
+		std::shared_lock<std::shared_timed_mutex> guard(lock_);
+		if (!ready_)
+			return 0;
+		auto it = leaves_.lower_bound(key);
+		return it == leaves_.end() ? 0 : it->second;
+	}
+
+	/* exclusive, held by a leaf SMO from its PMwCAS commit to the index update, and by the rebuild */
+	std::unique_lock<std::shared_timed_mutex> lock_smo() {
+		return std::unique_lock<std::shared_timed_mutex>(lock_);
+	}
+
+	bool stale() {
+		return stale_.load(std::memory_order_acquire);
+	}
+
+	/* the updates below run under lock_smo() */
+
+	/* replace the whole content, used by the rebuild */
+	void reset(leaf_list & leaves) {
+		leaves_.clear();
+		fences_.clear();
+		for (auto & l : leaves) {
+			fences_[l.second] = l.first;
+			leaves_[l.first] = l.second;
+		}
+		ready_ = true;
+		stale_.store(false, std::memory_order_release);
+	}
+
+	/* first leaf of an empty tree */
+	void add(const Key * fence, uint32_t fence_sz, uint64_t leaf) {
+		if (!ready_)
+			return;
+		std::string f = make_fence(fence, fence_sz);
+		fences_[leaf] = f;
+		leaves_[f] = leaf;
+	}
+
+	/* consolidate: same fence, new leaf */
+	void replace(uint64_t old_leaf, uint64_t new_leaf) {
+		if (!ready_)
+			return;
+		auto it = fences_.find(old_leaf);
+		if (it == fences_.end())
+			return invalidate();
+		std::string f = it->second;
+		fences_.erase(it);
+		fences_[new_leaf] = f;
+		leaves_[f] = new_leaf;
+	}
+
+	/* split: left takes separator @param K, right inherits the old fence */
+	void split(uint64_t old_leaf, const Key * K, uint32_t key_sz, uint64_t left, uint64_t right) {
+		if (!ready_)
+			return;
+		auto it = fences_.find(old_leaf);
+		if (it == fences_.end())
+			return invalidate();
+		std::string f = it->second;
+		std::string k = make_fence(K, key_sz);
+		fences_.erase(it);
+		fences_[right] = f;
+		leaves_[f] = right;
+		fences_[left] = k;
+		leaves_[k] = left;
+	}
+
+	/*
+	* merge: @param leaf and @param sibling are replaced by @param merged,
+	* which takes the larger fence of the two.
+	* sibling == 0 means @param leaf alone; merged == 0 means the leaves are dropped
+	*/
+	void merge(uint64_t leaf, uint64_t sibling, uint64_t merged) {
+		if (!ready_)
+			return;
+		std::string f;
+		bool found = false;
+		for (uint64_t old : { leaf, sibling }) {
+			if (!old)
+				continue;
+			auto it = fences_.find(old);
+			if (it == fences_.end())
+				return invalidate();
+			if (!found || fence_less()(f, it->second))
+				f = it->second;
+			found = true;
+			leaves_.erase(it->second);
+			fences_.erase(it);
+		}
+		if (found && merged) {
+			fences_[merged] = f;
+			leaves_[f] = merged;
+		}
+	}
+
+	/* drop everything until the next reset(), @param rebuild: flag it stale */
+	void invalidate(bool rebuild = true) {
+		leaves_.clear();
+		fences_.clear();
+		ready_ = false;
+		if (rebuild)
+			stale_.store(true, std::memory_order_release);
+	}
+};
+
+#endif // !BZINDEX_H
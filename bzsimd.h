@@ -0,0 +1,144 @@
+#ifndef BZSIMD_H
+#define BZSIMD_H
+
+#include <stdint.h>
+#include "bzconfig.h"
+
+#if !defined(BZ_NO_SIMD) && defined(__GNUC__) && defined(__x86_64__)
+#define BZ_SIMD_X86
+#include <immintrin.h>
+#endif
+
+/*
+* Vectorized scan of record meta words for the unsorted region of a leaf.
+* Each word is classified without pmwcas_read, bit i of a mask = meta[i]:
+* ctrl:    a PMwCAS control bit is set, the word must go through pmwcas_read
+* visible: a record, its key has to be compared
+* pending: invisible with offset == alloc_epoch, an insert in progress
+* Every other word (deleted or left by an older epoch) is skipped.
+* The kernel is picked once at runtime: AVX-512, AVX2 or the scalar loop.
+*/
+struct bz_meta_masks
+{
+	uint64_t ctrl;
+	uint64_t visible;
+	uint64_t pending;
+};
+
+#define BZ_META_CTRL_MASK		0xe000000000000000ULL
+#define BZ_META_VIS_MASK		0xf000000000000000ULL
+#define BZ_META_EPOCH_MASK		0xffffffff00000000ULL
+#define BZ_META_SCAN_MAX		64u
+
+/* visible bit unset and offset == @param alloc_epoch, control bits clear */
+inline uint64_t bz_meta_pending_word(uint32_t alloc_epoch) {
+	return ((uint64_t)1 << 60) | ((uint64_t)alloc_epoch << 32);
+}
+
+/* index of the lowest set bit, @param bits != 0 */
+inline uint32_t bz_ctz64(uint64_t bits) {
+#ifdef __GNUC__
+	return (uint32_t)__builtin_ctzll(bits);
+#else
+	uint32_t i = 0;
+	while (!(bits & 1)) {
+		bits >>= 1;
+		++i;
+	}
+	return i;
+#endif // __GNUC__
+}
+
+/* @param n <= BZ_META_SCAN_MAX */
+inline void bz_meta_scan_scalar(const uint64_t * meta, uint32_t n, uint32_t alloc_epoch, bz_meta_masks & m)
+{
+	uint64_t pending_word = bz_meta_pending_word(alloc_epoch);
+	m.ctrl = m.visible = m.pending = 0;
+	for (uint32_t i = 0; i < n; ++i) {
+		uint64_t w = ((volatile const uint64_t *)meta)[i];
+		uint64_t bit = (uint64_t)1 << i;
+		if (w & BZ_META_CTRL_MASK)
+			m.ctrl |= bit;
+		else if (!(w & BZ_META_VIS_MASK))
+			m.visible |= bit;
+		else if ((w & BZ_META_EPOCH_MASK) == pending_word)
+			m.pending |= bit;
+	}
+}
+
+#ifdef BZ_SIMD_X86
+/* each lane is an aligned 8-byte load, the same word pmwcas_read would see */
+__attribute__((target("avx2")))
+inline void bz_meta_scan_avx2(const uint64_t * meta, uint32_t n, uint32_t alloc_epoch, bz_meta_masks & m)
+{
+	const __m256i ctrl_mask = _mm256_set1_epi64x((long long)BZ_META_CTRL_MASK);
+	const __m256i vis_mask = _mm256_set1_epi64x((long long)BZ_META_VIS_MASK);
+	const __m256i epoch_mask = _mm256_set1_epi64x((long long)BZ_META_EPOCH_MASK);
+	const __m256i pending_word = _mm256_set1_epi64x((long long)bz_meta_pending_word(alloc_epoch));
+	const __m256i zero = _mm256_setzero_si256();
+	uint32_t i = 0;
+	m.ctrl = m.visible = m.pending = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m256i w = _mm256_loadu_si256((const __m256i *)(meta + i));
+		uint64_t no_ctrl = (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpeq_epi64(_mm256_and_si256(w, ctrl_mask), zero)));
+		uint64_t vis = (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpeq_epi64(_mm256_and_si256(w, vis_mask), zero)));
+		uint64_t pend = (uint64_t)_mm256_movemask_pd(_mm256_castsi256_pd(
+			_mm256_cmpeq_epi64(_mm256_and_si256(w, epoch_mask), pending_word)));
+		m.ctrl |= (~no_ctrl & 0xf) << i;
+		m.visible |= vis << i;
+		m.pending |= pend << i;
+	}
+	if (i < n) {
+		bz_meta_masks tail;
+		bz_meta_scan_scalar(meta + i, n - i, alloc_epoch, tail);
+		m.ctrl |= tail.ctrl << i;
+		m.visible |= tail.visible << i;
+		m.pending |= tail.pending << i;
+	}
+}
+
+__attribute__((target("avx512f")))
+inline void bz_meta_scan_avx512(const uint64_t * meta, uint32_t n, uint32_t alloc_epoch, bz_meta_masks & m)
+{
+	const __m512i ctrl_mask = _mm512_set1_epi64((long long)BZ_META_CTRL_MASK);
+	const __m512i vis_mask = _mm512_set1_epi64((long long)BZ_META_VIS_MASK);
+	const __m512i epoch_mask = _mm512_set1_epi64((long long)BZ_META_EPOCH_MASK);
+	const __m512i pending_word = _mm512_set1_epi64((long long)bz_meta_pending_word(alloc_epoch));
+	uint32_t i = 0;
+	m.ctrl = m.visible = m.pending = 0;
+	for (; i < n; i += 8) {
+		/* the tail is loaded under a mask, the lanes past @param n read nothing */
+		__mmask8 live = n - i >= 8 ? (__mmask8)0xff : (__mmask8)((1u << (n - i)) - 1);
+		__m512i w = _mm512_maskz_loadu_epi64(live, meta + i);
+		m.ctrl |= (uint64_t)_mm512_mask_test_epi64_mask(live, w, ctrl_mask) << i;
+		m.visible |= (uint64_t)_mm512_mask_testn_epi64_mask(live, w, vis_mask) << i;
+		m.pending |= (uint64_t)_mm512_mask_cmpeq_epi64_mask(live,
+			_mm512_and_si512(w, epoch_mask), pending_word) << i;
+	}
+}
+#endif // BZ_SIMD_X86
+
+typedef void(*bz_meta_scan_fn)(const uint64_t *, uint32_t, uint32_t, bz_meta_masks &);
+
+inline bz_meta_scan_fn bz_meta_scan_select()
+{
+#ifdef BZ_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return bz_meta_scan_avx512;
+	if (__builtin_cpu_supports("avx2"))
+		return bz_meta_scan_avx2;
+#endif // BZ_SIMD_X86
+	return bz_meta_scan_scalar;
+}
+
+/* classify meta[0, @param n), n <= BZ_META_SCAN_MAX */
+inline void bz_meta_scan(const uint64_t * meta, uint32_t n, uint32_t alloc_epoch, bz_meta_masks & m)
+{
+	static const bz_meta_scan_fn scan = bz_meta_scan_select();
+	scan(meta, n, alloc_epoch, m);
+}
+
+#endif // !BZSIMD_H
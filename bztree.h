@@ -6,10 +6,14 @@
 #include <tuple>
 #include <algorithm>
 #include <queue>
+#include <type_traits>
 
 #include "bzerrno.h"
 #include "PMwCAS.h"
 #include "utils.h"
+#include "bzindex.h"
+#include "bzsimd.h"
+#include "bzcodec.h"
 
 #include <mutex>
 #include <fstream>
@@ -26,15 +30,120 @@
 #define BZ_ACTION_UPDATE	3
 #define BZ_ACTION_UPSERT	4
 #define BZ_ACTION_READ		5
+#define BZ_ACTION_FETCH_ADD	6
+#define BZ_ACTION_CAS		7
 
 //Node types
-const uint64_t BZ_KEY_MAX = 0xdeadbeafdeadbeaf;
 #define BZ_TYPE_LEAF		1
 #define BZ_TYPE_NON_LEAF	2
 
-template<typename Key, typename Val>
+//Record parts of a copy into a compressed leaf
+#define BZ_COPY_ALL			0
+#define BZ_COPY_SHARED		1
+#define BZ_COPY_REST		2
+
+/*
+* Key order of a tree, the Cmp parameter of bz_tree / bz_node / bz_cursor.
+* compare:		three-way order of two keys
+* prefix:		8-byte prefix that agrees with compare (a < b => prefix(a) <= prefix(b))
+* hash:		keys equal under compare hash the same (leaf fingerprints)
+* has_prefix:	false skips the prefix arrays, prefix is never called
+* BZ_KEY_MAX sorts last whatever the order, it is never passed in.
+* The default follows the codec; a custom order derives from it and
+* overrides what it changes. All members are static so the calls inline.
+*/
+template<typename Key>
+struct bz_key_order
+{
+	static const bool has_prefix = true;
+	static int compare(const Key * k1, const Key * k2) {
+		return bz_codec<Key>::compare(k1, k2);
+	}
+	static uint64_t prefix(const Key * key) {
+		return bz_codec<Key>::prefix(key);
+	}
+	static uint64_t hash(const Key * key) {
+		return bz_codec<Key>::hash(key);
+	}
+};
+
+/* descending codec order, the complemented prefix still agrees with it */
+template<typename Key>
+struct bz_reverse_order : bz_key_order<Key>
+{
+	static int compare(const Key * k1, const Key * k2) {
+		return bz_codec<Key>::compare(k2, k1);
+	}
+	static uint64_t prefix(const Key * key) {
+		return ~bz_codec<Key>::prefix(key);
+	}
+};
+
+/*
+* base of the orders with no cheap order-preserving prefix (collations,
+* composite keys): searches compare the full keys.
+* Override hash as well when equal keys may differ in their bytes
+*/
+template<typename Key>
+struct bz_unprefixed_order : bz_key_order<Key>
+{
+	static const bool has_prefix = false;
+	static uint64_t prefix(const Key *) {
+		return 0;
+	}
+};
+
+template<typename Key, typename Val, typename Cmp = bz_key_order<Key>>
 struct bz_tree;
 
+/* key comparison shared by the nodes and the DRAM index */
+template<typename Key, typename Cmp = bz_key_order<Key>>
+struct bz_key_compare
+{
+	int operator()(const Key * k1, const Key * k2) const {
+		if (bz_codec<Key>::is_max(k1))
+			return 1;
+		if (bz_codec<Key>::is_max(k2))
+			return -1;
+		return Cmp::compare(k1, k2);
+	}
+};
+
+/*
+* 8-byte normalized key prefix, compared as an unsigned integer:
+* a smaller prefix means a smaller key, equal prefixes need the full keys
+*/
+template<typename Key, typename Cmp = bz_key_order<Key>>
+struct bz_key_prefix
+{
+	uint64_t operator()(const Key * key) const {
+		if (bz_codec<Key>::is_max(key))
+			return UINT64_MAX;
+		return Cmp::prefix(key);
+	}
+};
+
+/* one-byte key fingerprint for the unsorted region of a leaf, never 0 (0: not written yet) */
+template<typename Key, typename Cmp = bz_key_order<Key>>
+struct bz_key_fingerprint
+{
+	uint8_t operator()(const Key * key) const {
+		uint8_t fp = (uint8_t)(Cmp::hash(key) >> 56);
+		return fp ? fp : 1;
+	}
+};
+
+/* one record of a batched write, @param ret receives its result */
+template<typename Key, typename Val>
+struct bz_write_op
+{
+	const Key *	key;
+	const Val *	val;
+	uint32_t	key_size;
+	uint32_t	total_size;
+	int			ret;
+};
+
 //Print
 #include <iomanip>
 std::mutex mylock;
@@ -42,90 +151,149 @@ std::fstream fs("log.txt", std::ios::app);
 
 /* BzTreeڵͷ */
 //Ҷڵ㣬ValʵݵͣValΪuint64_tӽڵָ
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp = bz_key_order<Key>>
 struct bz_node
 {
-	/* length 32: node size, 31: sorted count, 1: is_leaf */
+	/* length 16: generation, 16: node size, 31: sorted count, 1: is_leaf */
 	uint64_t length_;
 	/* status 3: PMwCAS control, 1: frozen, 16: record count, 22: block size, 22: delete size */
 	uint64_t status_;
+	/* offset of the normalized key prefixes of the sorted region, 0: none */
+	uint32_t prefix_off_;
+	/*
+	* leaf key compression: the cpfx_len_ bytes at the end of the node are the
+	* common prefix of the records at offset >= cpfx_off_, stored without it
+	*/
+	uint32_t cpfx_off_;
+	uint32_t cpfx_len_;
+	/* key fingerprints of the unsorted region, slot sorted count + i, written before the slot turns visible */
+	uint8_t fingerprints_[NODE_FINGERPRINTS];
 	/* record meta entry 3: PMwCAS control, 1: visiable, 28: offset, 16: key length, 16: total length */
 	uint64_t * rec_meta_arr();
 
 	/* K-V getter and setter */
 	Key * get_key(uint64_t meta);
-	void set_key(uint32_t offset, const Key * key);
-	void copy_key(Key * dst, const Key * src);
+	void set_key(uint32_t offset, const Key * key, uint32_t key_size);
 	Val * get_value(uint64_t meta);
-	void set_value(uint32_t offset, const Val * val);
-	void copy_value(Val * dst, const Val * src);
+	void set_value(uint32_t offset, const Val * val, uint32_t val_size);
+	uint64_t * value_word(uint64_t meta);
+	void read_value(Val * dst, uint64_t meta);
+	uint64_t record_version(uint32_t pos);
 
 	/* ֵȽϺ */
 	int key_cmp(uint64_t meta_1, const Key * key);
 	bool key_cmp_meta(uint64_t meta_1, uint64_t meta_2);
 
+	/* leaf key compression, see bz_prefix_codec */
+	static const bool compress_keys =
+#ifndef BZ_NO_KEY_COMPRESSION
+		bz_prefix_codec<Key>::enabled && std::is_same<Cmp, bz_key_order<Key>>::value;
+#else
+		false;
+#endif // !BZ_NO_KEY_COMPRESSION
+	bool key_stripped(uint64_t meta);
+	const uint8_t * key_prefix();
+	bz_split_key split_key(uint64_t meta);
+	uint32_t full_key_length(uint64_t meta);
+	const Key * full_key(uint64_t meta, std::string & buf);
+	bool shares_prefix(uint64_t meta, const uint8_t * pfx, uint32_t p);
+	void common_key_prefix(const uint64_t * metas, uint32_t n, bool stripped_only, std::string & pfx, bool & found);
+	static std::string pick_key_prefix(std::initializer_list<std::tuple<bz_node *, const uint64_t *, uint32_t>> srcs);
+	void fr_set_prefix(const std::string & pfx);
+	void fr_close_prefix();
+	uint64_t copy_record_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint64_t meta_rd, uint32_t blk_sz, bool strip);
+	/* suffix truncation of the separators posted by leaf splits, see bz_prefix_codec::separator */
+	static const bool truncate_separators =
+#ifndef BZ_NO_SEPARATOR_TRUNCATION
+		bz_prefix_codec<Key>::enabled && std::is_same<Cmp, bz_key_order<Key>>::value;
+#else
+		false;
+#endif // !BZ_NO_SEPARATOR_TRUNCATION
+	const Key * separator_key(uint64_t meta_lo, rel_ptr<bz_node<Key, Val, Cmp>> hi, uint64_t meta_hi, std::string & buf, uint32_t & key_sz);
+
 	/*  */
 	/*  */
 	uint32_t binary_search(const Key * key, int size = 0, uint64_t * meta_arr = nullptr);
+	uint32_t inner_search(const Key * key, uint32_t size);
 	bool find_key_sorted(const Key * key, uint32_t &pos);
 	bool find_key_unsorted(const Key * key, uint64_t status_rd, uint32_t alloc_epoch, uint32_t &pos, bool &recheck);
 	uint64_t status_add_rec_blk(uint64_t status_rd, uint32_t total_size);
 	uint64_t status_del(uint64_t status_rd, uint32_t total_size);
 	template<typename TreeVal>
-	bool add_dele_sz(bz_tree<Key, TreeVal> * tree, uint32_t total_size);
+	bool add_dele_sz(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t total_size);
 	uint64_t status_frozen(uint64_t status_rd);
 	uint64_t meta_vis_off(uint64_t meta_rd, bool set_vis, uint32_t new_offset);
 	uint64_t meta_vis_off_klen_tlen(uint64_t meta_rd, bool set_vis, uint32_t new_offset, uint32_t key_size, uint32_t total_size);
 	void copy_data(uint32_t new_offset, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size);
-	void copy_data(uint64_t meta_rd, std::vector<std::pair<std::shared_ptr<Key>, std::shared_ptr<Val>>> & res);
 	template<typename TreeVal>
-	int rescan_unsorted(bz_tree<Key, TreeVal> * tree, uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t total_size, uint32_t alloc_epoch);
+	int rescan_unsorted(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t total_size, uint32_t alloc_epoch);
+	bool find_dup_unsorted(uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t alloc_epoch);
+	void set_fingerprint(uint32_t pos, const Key * key);
+	void persist_fingerprints(uint32_t pos, uint32_t n);
+	bool fingerprint_mismatch(uint32_t pos, uint32_t sorted_cnt, uint8_t fp);
 
 	/* SMO */
 	int triger_consolidate();
 	
-	uint32_t copy_node_to(rel_ptr<bz_node<Key, Val>> dst, uint64_t status_rd = 0);
+	uint32_t copy_node_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint64_t status_rd = 0, int part = BZ_COPY_ALL);
 	void fr_sort_meta();
+	void sort_meta_tail(uint64_t * metas, uint32_t sorted_cnt, uint32_t cnt);
 	void fr_remove_meta(int pos);
 	int fr_insert_meta(const Key * key, uint64_t left, uint32_t key_sz, uint64_t right);
 	int fr_root_init(const Key * key, uint64_t left, uint32_t key_sz, uint64_t right);
+	int fr_append_meta(const Key * key, const Val * val, uint32_t key_sz, uint32_t tot_sz, uint32_t limit);
+	void fr_build_prefixes();
 
-	uint32_t copy_sort_meta_to(rel_ptr<bz_node<Key, Val>> dst);
-	uint32_t copy_payload_to(rel_ptr<bz_node<Key, Val>> dst, uint32_t new_rec_cnt);
-	void init_header(rel_ptr<bz_node<Key, Val>> dst, uint32_t new_rec_cnt, uint32_t blk_sz, int leaf_opt = 0, uint32_t dele_sz = 0);
+	uint32_t copy_sort_meta_to(rel_ptr<bz_node<Key, Val, Cmp>> dst);
+	uint32_t copy_payload_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint32_t new_rec_cnt);
+	void init_header(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint32_t new_rec_cnt, uint32_t blk_sz, int leaf_opt = 0, uint32_t dele_sz = 0);
 	uint32_t valid_block_size(uint64_t status_rd = 0);
-	uint32_t valid_node_size(uint64_t status_rd = 0);
+	uint32_t valid_node_size(uint64_t status_rd = 0, bool full = false);
 	uint32_t valid_record_count(uint64_t status_rd = 0);
-	uint32_t fr_get_balanced_count(rel_ptr<bz_node<Key, Val>> dst);
+	uint32_t fr_get_balanced_count(rel_ptr<bz_node<Key, Val, Cmp>> dst);
 
 	rel_ptr<uint64_t> nth_child(int n);
 	Key * nth_key(int n);
 	Val * nth_val(int n);
 	
 	template<typename TreeVal>
-	mdesc_t try_freeze(bz_tree<Key, TreeVal> * tree);
+	mdesc_t try_freeze(bz_tree<Key, TreeVal, Cmp> * tree);
 	template<typename TreeVal>
-	bool unfreeze(bz_tree<Key, TreeVal> * tree);
+	bool unfreeze(bz_tree<Key, TreeVal, Cmp> * tree);
 
 	template<typename TreeVal>
-	int consolidate(bz_tree<Key, TreeVal> * tree, rel_ptr<uint64_t> parent_status, rel_ptr<uint64_t> parent_ptr);
+	int consolidate(bz_tree<Key, TreeVal, Cmp> * tree, rel_ptr<uint64_t> parent_status, rel_ptr<uint64_t> parent_ptr);
 	template<typename TreeVal>
-	int split(bz_tree<Key, TreeVal> * tree, rel_ptr<bz_node<Key, uint64_t>> parent, rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr);
+	int split(bz_tree<Key, TreeVal, Cmp> * tree, rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr);
 	template<typename TreeVal>
-	int merge(bz_tree<Key, TreeVal> * tree, int child_id, rel_ptr<bz_node<Key, uint64_t>> parent, rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr);
+	int merge(bz_tree<Key, TreeVal, Cmp> * tree, int child_id, rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr);
 
 	/* ִҶڵ */
 	template<typename TreeVal>
-	int insert(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch);
+	int insert(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch);
+	template<typename TreeVal>
+	int remove(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const uint64_t * version = nullptr);
+	template<typename TreeVal>
+	int update(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch, const uint64_t * version = nullptr);
 	template<typename TreeVal>
-	int remove(bz_tree<Key, TreeVal> * tree, const Key * key);
+	int update_inplace(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t pos, uint64_t status_rd, const Val * val, uint32_t key_size, uint32_t total_size);
 	template<typename TreeVal>
-	int update(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch);
+	int write_inplace(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t pos, uint64_t status_rd, int action, uint64_t arg, uint64_t * io);
 	template<typename TreeVal>
-	int   read(bz_tree<Key, TreeVal> * tree, const Key * key, Val * buffer, uint32_t max_val_size);
+	int rmw(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, int action, const Val * arg, Val * io);
 	template<typename TreeVal>
-	int upsert(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch);
-	std::vector<std::pair<std::shared_ptr<Key>, std::shared_ptr<Val>>> range_scan(const Key * beg_key, const Key * end_key);
+	int   read(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, Val * buffer, uint32_t max_val_size, uint64_t * version = nullptr);
+	template<typename TreeVal>
+	int upsert(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch);
+	template<typename TreeVal>
+	int write_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, bool upsert, uint32_t alloc_epoch, uint32_t & done);
+	uint32_t drop_batch_slot(uint32_t rec_cnt, int * grp_ret, uint32_t j, int ret, uint32_t total_size);
+	template<typename TreeVal>
+	int reserve_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, bool upsert, uint32_t alloc_epoch, int * del_pos, uint32_t * new_offset, uint32_t & rec_cnt);
+	int publish_batch_words(bz_write_op<Key, Val> ** ops, uint32_t n, uint32_t alloc_epoch, const int * del_pos, const uint32_t * new_offset, uint32_t rec_cnt,
+		std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> & casn);
+	template<typename TreeVal>
+	void drop_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, uint32_t rec_cnt);
 
 	void print_log(const char * action, const Key * k = nullptr, uint64_t ret = -1, bool pr = 
 #ifdef BZ_DEBUG
@@ -138,22 +306,41 @@ struct bz_node
 };
 
 /* BzTree */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 struct bz_tree {
+	typedef bz_dram_index<Key, bz_key_compare<Key, Cmp>> dram_index_t;
+
 	PMEMobjpool *				pop_;
 	pmwcas_pool					pool_;
 	uint64_t					root_;
 	uint32_t					epoch_;
+	/* hybrid mode: volatile leaf index, rebuilt on every recovery */
+	dram_index_t *				dram_;
 
 	void first_use(PMEMobjpool * pop, PMEMoid base_oid);
-	int init(PMEMobjpool * pop, PMEMoid base_oid);
+	int init(PMEMobjpool * pop, PMEMoid base_oid, bool dram_inner = false);
 	void recovery();
 	void finish();
 	int insert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size);
 	int remove(const Key * key);
 	int update(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size);
 	int upsert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size);
-	int   read(const Key * key, Val * buffer, uint32_t max_val_size);
+	int   read(const Key * key, Val * buffer, uint32_t max_val_size, uint64_t * version = nullptr);
+	int update_if_version(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint64_t version);
+	int remove_if_version(const Key * key, uint64_t version);
+	int remove_range(const Key * beg, const Key * end = nullptr);
+	int fetch_add(const Key * key, uint64_t delta, Val * old_val = nullptr);
+	int compare_and_swap(const Key * key, Val * expected, const Val * desired);
+	int multi_get(const Key * const * keys, uint32_t n, Val * const * buffers, uint32_t max_val_size, int * rets);
+	int lower_bound(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size);
+	int upper_bound(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size);
+	int floor(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size, bool incl = true);
+	int ceil(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size, bool incl = true);
+	int multi_insert(bz_write_op<Key, Val> * ops, uint32_t n);
+	int multi_upsert(bz_write_op<Key, Val> * ops, uint32_t n);
+	int atomic_insert(bz_write_op<Key, Val> * ops, uint32_t n);
+	int atomic_upsert(bz_write_op<Key, Val> * ops, uint32_t n);
+	int bulk_load(const bz_write_op<Key, Val> * ops, uint32_t n, float fill = BULK_LOAD_FILL, int threads = 1);
 
 
 	/*  */
@@ -164,10 +351,28 @@ struct bz_tree {
 	template<typename NType>
 	bool smo(bz_path_stack * path_stack, int & ret);
 	int new_root();
-	int traverse(int action, bool wr, const Key * key, const Val * val = nullptr, uint32_t key_size = 0, uint32_t total_size = 0, Val * buffer = nullptr, uint32_t max_val_size = 0);
+	int traverse(int action, bool wr, const Key * key, const Val * val = nullptr, uint32_t key_size = 0, uint32_t total_size = 0, Val * buffer = nullptr, uint32_t max_val_size = 0, uint64_t * version = nullptr);
+	int execute(rel_ptr<bz_node<Key, Val, Cmp>> node, int action, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, Val * buffer, uint32_t max_val_size, uint64_t * version);
+	int multi_write(bz_write_op<Key, Val> * ops, uint32_t n, bool upsert);
+	int atomic_write(bz_write_op<Key, Val> * ops, uint32_t n, bool upsert);
+	void multi_get_dfs(uint64_t ptr, const Key * const * keys, const uint32_t * order, uint32_t n, Val * const * buffers, uint32_t max_val_size, int * rets);
+	int neighbour(const Key * key, bool reverse, bool incl, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size);
+	int unlink_leaves(rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, uint64_t status_parent, int first, int n,
+		rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr);
+
+	static bool valid_value(const Val * val, uint32_t val_size);
+
+	/* DRAM index */
+	std::unique_lock<std::shared_timed_mutex> lock_dram_index(bool leaf = true);
+	void rebuild_dram_index(bool stale_only = false);
+	void collect_leaves(rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, uint32_t n, typename dram_index_t::leaf_list & leaves);
 
 	template<typename NType>
-	rel_ptr<rel_ptr<bz_node<Key, NType>>> alloc_node(mdesc_t mdesc, int magic = 0);
+	rel_ptr<rel_ptr<bz_node<Key, NType, Cmp>>> alloc_node(mdesc_t mdesc, int magic = 0);
+	template<typename NType>
+	rel_ptr<bz_node<Key, NType, Cmp>> bulk_alloc(mdesc_t & mdesc, std::vector<uint64_t> & nodes);
+	void bulk_release(const std::vector<uint64_t> & nodes);
+	int bulk_build_leaves(const bz_write_op<Key, Val> * ops, uint32_t n, uint32_t limit, std::vector<uint64_t> & nodes, std::vector<uint64_t> & leaves);
 	mdesc_t alloc_mdesc(int recycle = 0);
 	void recycle_node(rel_ptr<rel_ptr<uint64_t>> ptr);
 	int pack_pmwcas(std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn);
@@ -184,17 +389,124 @@ struct bz_tree {
 
 };
 
-template<typename Key, typename Val>
-int bz_tree<Key, Val>::traverse(int action, bool wr, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, Val * buffer, uint32_t max_val_size)
+/*
+* Record copied out by bz_cursor::fill: the key immediately followed by
+* the value, as laid out in the leaf; entries are padded to 8 bytes
+*/
+struct bz_scan_rec
+{
+	uint32_t key_size;
+	uint32_t total_size;
+
+	const char * key() const { return (const char*)(this + 1); }
+	const char * value() const { return key() + key_size; }
+	const bz_scan_rec * next() const {
+		return (const bz_scan_rec*)(key() + ((total_size + 7) & ~7u));
+	}
+};
+
+/*
+* Tree-level range-scan cursor
+* The cursor pins the G/C epoch for its whole lifetime, so key() and value()
+* point straight into the leaf payload and the parent path of the current
+* leaf stays readable: moving to the next leaf walks up the path to the
+* right sibling instead of re-descending from the root.
+* A frozen sibling has been (or is being) replaced by an SMO, in that case the
+* cursor re-seeks from the root, strictly past the fence of the last leaf.
+* A reverse cursor returns keys in descending order, walking leaves right to left.
+* With BZ_INPLACE_VALUE an 8-byte value may be under PMwCAS: read it through
+* pmwcas_read, or use fill(), which does.
+* A key stored without the prefix of a compressed leaf is rebuilt in the cursor,
+* key() then stays valid until the second next() after it.
+* Keep cursors short-lived: a pinned epoch holds back memory reclamation.
+*/
+template<typename Key, typename Val, typename Cmp = bz_key_order<Key>>
+struct bz_cursor
+{
+	bz_tree<Key, Val, Cmp> *		tree_;
+	bz_path_stack			path_;
+	rel_ptr<bz_node<Key, Val, Cmp>>	leaf_;
+	/* visible records of the current leaf in range, in scan order */
+	std::vector<uint64_t>	metas_;
+	/* in-range records of the unsorted region, sorted on their own */
+	std::vector<uint64_t>	tail_;
+	uint32_t				pos_;
+	/* where the scan resumes: last key of an exhausted leaf, or its fence */
+	const Key *				from_;
+	bool					from_incl_;
+	std::string				from_buf_;
+	/* rebuilt keys of the current and the previous record */
+	std::string				key_bufs_[2];
+	uint32_t				steps_;
+	std::string				beg_buf_;
+	std::string				end_buf_;
+	const Key *				end_;
+	bool					siblings_;
+	bool					reverse_;
+
+	bz_cursor(bz_tree<Key, Val, Cmp> * tree, bool follow_siblings = true, bool reverse = false);
+	~bz_cursor();
+
+	void seek(const Key * beg_key, const Key * end_key = nullptr);
+	void next();
+	bool valid();
+	const Key * key();
+	const Val * value();
+	uint32_t key_size();
+	uint32_t value_size();
+	uint32_t fill(char * buf, uint32_t buf_size, uint32_t & used);
+	int copy_record(Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size);
+
+	/* internal */
+	static void copy_bound(std::string & buf, const Key * key);
+	bool after_from(uint64_t meta_rd);
+	bool before_end(uint64_t meta_rd);
+	void descend(const Key * key);
+	const Key * lower_fence();
+	bool next_leaf();
+	bool step_right();
+	bool step_left();
+	void load_leaf();
+};
+
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::traverse(int action, bool wr, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, Val * buffer, uint32_t max_val_size, uint64_t * version)
 {
+	if ((action == BZ_ACTION_INSERT || action == BZ_ACTION_UPDATE || action == BZ_ACTION_UPSERT)
+		&& !valid_value(val, total_size - key_size))
+		return EVALUE;
 	register_this();
 	if (!pmwcas_read(&root_)) {
 		new_root();
 	}
 	bz_path_stack path_stack;
 	int retry = 0;
+	/*
+	* hybrid mode: jump to the leaf through the DRAM index, SMOs take the persistent path;
+	* a leaf frozen by an SMO sends the operation down the persistent path, which helps it along
+	*/
+	bool use_index = dram_ != nullptr;
 	while (true)
 	{
+		if (use_index) {
+			if (dram_->stale())
+				rebuild_dram_index(true);
+			acquire_rd();
+			rel_ptr<bz_node<Key, Val, Cmp>> leaf(dram_->find(key));
+			if (!leaf.is_null() && (!wr || !leaf->triger_consolidate())) {
+				int ret = execute(leaf, action, key, val, key_size, total_size, buffer, max_val_size, version);
+				release();
+				if (ret == EPMWCASALLOC || ret == EFROZEN) {
+					use_index = false;
+					if (ret == EPMWCASALLOC)
+						std::this_thread::sleep_for(std::chrono::milliseconds(++retry));
+					continue;
+				}
+				return ret;
+			}
+			release();
+		}
+
 		path_stack.reset();
 		uint64_t root = pmwcas_read(&root_);
 		path_stack.push(root, -1);
@@ -209,18 +521,7 @@ int bz_tree<Key, Val>::traverse(int action, bool wr, const Key * key, const Val
 
 			uint64_t ptr = path_stack.get_node();
 			if (is_leaf_node(ptr)) {
-				rel_ptr<bz_node<Key, Val>> node(ptr);
-				int ret;
-				if (action == BZ_ACTION_INSERT)
-					ret = node->insert(this, key, val, key_size, total_size, epoch_);
-				else if (action == BZ_ACTION_DELETE)
-					ret = node->remove(this, key);
-				else if (action == BZ_ACTION_UPDATE)
-					ret = node->update(this, key, val, key_size, total_size, epoch_);
-				else if (action == BZ_ACTION_UPSERT)
-					ret = node->upsert(this, key, val, key_size, total_size, epoch_);
-				else
-					ret = node->read(this, key, buffer, max_val_size);
+				int ret = execute(rel_ptr<bz_node<Key, Val, Cmp>>(ptr), action, key, val, key_size, total_size, buffer, max_val_size, version);
 				release();
 				if (ret == EPMWCASALLOC || ret == EFROZEN) {
 					std::this_thread::sleep_for(std::chrono::milliseconds(++retry));
@@ -229,7 +530,7 @@ int bz_tree<Key, Val>::traverse(int action, bool wr, const Key * key, const Val
 				return ret;
 			}
 			else {
-				rel_ptr<bz_node<Key, uint64_t>> node(ptr);
+				rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
 				int child_id = (int)node->binary_search(key);
 				uint64_t next = *node->nth_val(child_id);
 				while (next & MwCAS_BIT || next & RDCSS_BIT || next & DIRTY_BIT) {
@@ -245,16 +546,50 @@ int bz_tree<Key, Val>::traverse(int action, bool wr, const Key * key, const Val
 	}
 }
 
-template<typename Key, typename Val>
-inline void bz_tree<Key, Val>::register_this()
+/*
+* under BZ_INPLACE_VALUE an 8-byte value is read back, and copied by SMOs, through
+* pmwcas_read: one with a PMwCAS control bit set would read as a descriptor, EVALUE
+*/
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_tree<Key, Val, Cmp>::valid_value(const Val * val, uint32_t val_size)
+{
+#ifdef BZ_INPLACE_VALUE
+	if (sizeof(Val) == sizeof(uint64_t) && val_size == sizeof(uint64_t)) {
+		uint64_t word;
+		memcpy(&word, val, sizeof(word));
+		return !(word & (MwCAS_BIT | RDCSS_BIT | DIRTY_BIT));
+	}
+#endif // BZ_INPLACE_VALUE
+	return true;
+}
+
+/* run a single-key action on the leaf, @param version: record version (read) or the expected one (update, delete) */
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::execute(rel_ptr<bz_node<Key, Val, Cmp>> node, int action, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, Val * buffer, uint32_t max_val_size, uint64_t * version)
+{
+	if (action == BZ_ACTION_INSERT)
+		return node->insert(this, key, val, key_size, total_size, epoch_);
+	else if (action == BZ_ACTION_DELETE)
+		return node->remove(this, key, version);
+	else if (action == BZ_ACTION_UPDATE)
+		return node->update(this, key, val, key_size, total_size, epoch_, version);
+	else if (action == BZ_ACTION_UPSERT)
+		return node->upsert(this, key, val, key_size, total_size, epoch_);
+	else if (action == BZ_ACTION_FETCH_ADD || action == BZ_ACTION_CAS)
+		return node->rmw(this, key, action, val, buffer);
+	return node->read(this, key, buffer, max_val_size, version);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline void bz_tree<Key, Val, Cmp>::register_this()
 {
 	gc_register(pool_.gc);
 }
 
 /* ǷҪڵṹ & GCٽ */
 /* @param path_stack <ڵԵַ, ڵ㵽ָԵַ> */
-template<typename Key, typename Val>
-bool bz_tree<Key, Val>::acquire_wr(bz_path_stack * path_stack)
+template<typename Key, typename Val, typename Cmp>
+bool bz_tree<Key, Val, Cmp>::acquire_wr(bz_path_stack * path_stack)
 {
 	//ʽڵ
 	gc_crit_enter(pool_.gc);
@@ -278,53 +613,56 @@ bool bz_tree<Key, Val>::acquire_wr(bz_path_stack * path_stack)
 	return smo_type;
 }
 /* GCٽ */
-template<typename Key, typename Val>
-inline void bz_tree<Key, Val>::acquire_rd()
+template<typename Key, typename Val, typename Cmp>
+inline void bz_tree<Key, Val, Cmp>::acquire_rd()
 {
 	//ڵ
 	gc_crit_enter(pool_.gc);
 }
-template<typename Key, typename Val>
-inline void bz_tree<Key, Val>::release()
+template<typename Key, typename Val, typename Cmp>
+inline void bz_tree<Key, Val, Cmp>::release()
 {
 	//˳ڵ
 	gc_crit_exit(pool_.gc);
 }
 
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename NType>
-bool bz_tree<Key, Val>::smo(bz_path_stack * path_stack, int & ret)
+bool bz_tree<Key, Val, Cmp>::smo(bz_path_stack * path_stack, int & ret)
 {
-	rel_ptr<bz_node<Key, NType>> node(path_stack->get_node());
+	rel_ptr<bz_node<Key, NType, Cmp>> node(path_stack->get_node());
 	int child_id = path_stack->get_child_id();
 	int smo_type = node->triger_consolidate();
-	if (smo_type == BZ_CONSOLIDATE) {
+	/* another SMO holds the node: back off */
+	if (smo_type == BZ_FROZEN)
+		ret = EFROZEN;
+	else if (smo_type == BZ_CONSOLIDATE) {
 	CONSOLIDATE_TAG:
 		if (child_id < 0) {
 			ret = node->consolidate<Val>(this, rel_ptr<uint64_t>::null(), rel_ptr<uint64_t>::null());
 		}
 		else {
 			path_stack->pop();
-			rel_ptr<bz_node<Key, uint64_t>> parent(path_stack->get_node());
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_stack->get_node());
 			ret = node->consolidate<Val>(this, &parent->status_, parent->nth_val(child_id));
 			path_stack->push();
 		}
 	}
 	else if (smo_type == BZ_SPLIT) {
 		if (child_id < 0) {
-			ret = node->split<Val>(this, rel_ptr<bz_node<Key, uint64_t>>::null(),
+			ret = node->split<Val>(this, rel_ptr<bz_node<Key, uint64_t, Cmp>>::null(),
 				rel_ptr<uint64_t>::null(), rel_ptr<uint64_t>::null());
 		}
 		else {
 			path_stack->pop();
-			rel_ptr<bz_node<Key, uint64_t>> parent(path_stack->get_node());
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_stack->get_node());
 			int grand_id = path_stack->get_child_id();
 			if (grand_id < 0) {
 				ret = node->split<Val>(this, parent, rel_ptr<uint64_t>::null(), rel_ptr<uint64_t>::null());
 			}
 			else {
 				path_stack->pop();
-				rel_ptr<bz_node<Key, uint64_t>> grandpa(path_stack->get_node());
+				rel_ptr<bz_node<Key, uint64_t, Cmp>> grandpa(path_stack->get_node());
 				ret = node->split<Val>(this, parent, &grandpa->status_, grandpa->nth_val(grand_id));
 				path_stack->push();
 			}
@@ -335,36 +673,43 @@ bool bz_tree<Key, Val>::smo(bz_path_stack * path_stack, int & ret)
 		if (child_id < 0)
 			goto CONSOLIDATE_TAG;
 		path_stack->pop();
-		rel_ptr<bz_node<Key, uint64_t>> parent(path_stack->get_node());
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_stack->get_node());
 		int grand_id = path_stack->get_child_id();
 		if (grand_id < 0) {
 			ret = node->merge<Val>(this, child_id, parent, rel_ptr<uint64_t>::null(), rel_ptr<uint64_t>::null());
 		}
 		else {
 			path_stack->pop();
-			rel_ptr<bz_node<Key, uint64_t>> grandpa(path_stack->get_node());
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> grandpa(path_stack->get_node());
 			ret = node->merge<Val>(this, child_id, parent, &grandpa->status_, grandpa->nth_val(grand_id));
 			path_stack->push();
 		}
 		path_stack->push();
+		/* no sibling can absorb the node: consolidate it, it would stay full otherwise */
+		if (ret == ENONEED)
+			goto CONSOLIDATE_TAG;
 	}
 	return smo_type && (ret == EFROZEN || !ret || ret == EPMWCASALLOC);
 }
 
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename NType>
-rel_ptr<rel_ptr<bz_node<Key, NType>>> bz_tree<Key, Val>::alloc_node(mdesc_t mdesc, int magic)
+rel_ptr<rel_ptr<bz_node<Key, NType, Cmp>>> bz_tree<Key, Val, Cmp>::alloc_node(mdesc_t mdesc, int magic)
 {
-	rel_ptr<rel_ptr<bz_node<Key, NType>>> new_node_ptr =
-		pmwcas_reserve<bz_node<Key, NType>>(mdesc, 
+	rel_ptr<rel_ptr<bz_node<Key, NType, Cmp>>> new_node_ptr =
+		pmwcas_reserve<bz_node<Key, NType, Cmp>>(mdesc, 
 			get_magic(&pool_, magic), 0, NOCAS_RELEASE_NEW_ON_FAILED);
 
 	pool_.mem_.acquire(new_node_ptr);
 
 	uint32_t node_sz = NODE_ALLOC_SIZE;
-	rel_ptr<bz_node<Key, NType>> node = *new_node_ptr;
-	memset(node.abs(), 0, sizeof(bz_node<Key, NType>));
+	rel_ptr<bz_node<Key, NType, Cmp>> node = *new_node_ptr;
+	/* a recycled node carries on the generation of its last use, see record_version() */
+	uint64_t gen = get_node_gen(node->length_) + 1;
+	/* the whole node: a new meta entry is read with pmwcas_read before it is written */
+	memset(node.abs(), 0, node_sz);
 	set_node_size(node->length_, node_sz);
+	set_node_gen(node->length_, gen);
 	persist(node.abs(), sizeof(bz_node<uint64_t, uint64_t>));
 	return new_node_ptr;
 	/*
@@ -375,15 +720,15 @@ rel_ptr<rel_ptr<bz_node<Key, NType>>> bz_tree<Key, Val>::alloc_node(mdesc_t mdes
 	} TX_END;
 	assert(!new_node_ptr->is_null());
 
-	rel_ptr<bz_node<Key, Val>> new_node = *new_node_ptr;
+	rel_ptr<bz_node<Key, Val, Cmp>> new_node = *new_node_ptr;
 	memset(new_node.abs(), 0, NODE_ALLOC_SIZE);
 	set_node_size(new_node->length_, NODE_ALLOC_SIZE);
 	return new_node;
 	*/
 }
 
-template<typename Key, typename Val>
-int bz_node<Key, Val>::triger_consolidate()
+template<typename Key, typename Val, typename Cmp>
+int bz_node<Key, Val, Cmp>::triger_consolidate()
 {
 	uint64_t status_rd = pmwcas_read(&status_);
 	if (is_frozen(status_rd))
@@ -411,19 +756,18 @@ merge N
 1.1 shares the same parent
 1.2 small enough to absorb N's records
 2. if neither is ok, return false
-3. freeze N and L status
+3. freeze N, L and P status
 4. allocate 2 new nodes:
 4.1 new node N' contains N and L's records
 4.2 N and L parent P' that swaps the child ptr to L to N'
-5. 3-word PMwCAS
+5. 2-word PMwCAS
 5.1 G's child ptr to P
 5.2 G's status
-5.3 freeze P
 */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
-	rel_ptr<bz_node<Key, uint64_t>> parent,
+int bz_node<Key, Val, Cmp>::merge(bz_tree<Key, TreeVal, Cmp> * tree, int child_id,
+	rel_ptr<bz_node<Key, uint64_t, Cmp>> parent,
 	rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr)
 {
 
@@ -432,9 +776,9 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 	uint64_t status_cur;
 	uint64_t status_sibling;
 	int sibling_type = 0; //-1:  1: 
-	rel_ptr<bz_node<Key, Val>> sibling;
-	rel_ptr<rel_ptr<bz_node<Key, Val>>> new_node_ptr;
-	rel_ptr<rel_ptr<bz_node<Key, uint64_t>>> new_parent_ptr;
+	rel_ptr<bz_node<Key, Val, Cmp>> sibling;
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>> new_node_ptr;
+	rel_ptr<rel_ptr<bz_node<Key, uint64_t, Cmp>>> new_parent_ptr;
 	uint32_t child_max;
 	int ret = 0;
 	bool forbids[2] = { false, false };
@@ -484,7 +828,8 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 		}
 		child_max = get_record_count(status_parent);
 		
-		uint32_t cur_sz = valid_node_size(status_cur);
+		/* stripped keys counted in full, the merged leaf may share a shorter prefix */
+		uint32_t cur_sz = valid_node_size(status_cur, true);
 
 		//ѡֵܽڵ
 		if (!forbids[0] && child_id > 0) {
@@ -492,7 +837,7 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 			sibling = parent->nth_child(child_id - 1);
 			status_sibling = pmwcas_read(&sibling->status_);
 			if (!is_frozen(status_sibling)) {
-				uint32_t left_sz = sibling->valid_node_size(status_sibling);
+				uint32_t left_sz = sibling->valid_node_size(status_sibling, true);
 				if (cur_sz + left_sz - sizeof(*this) < NODE_SPLIT_SIZE) {
 					sibling_type = -1;
 				}
@@ -506,7 +851,7 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 			sibling = parent->nth_child(child_id + 1);
 			status_sibling = pmwcas_read(&sibling->status_);
 			if (!is_frozen(status_sibling)) {
-				uint32_t right_sz = sibling->valid_node_size(status_sibling);
+				uint32_t right_sz = sibling->valid_node_size(status_sibling, true);
 				if (cur_sz + right_sz - sizeof(*this) < NODE_SPLIT_SIZE) {
 					sibling_type = 1;
 				}
@@ -542,30 +887,52 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 
 	//ɾڵ
 	if (parent.is_null()) {
-		pmwcas_add(mdesc, &tree->root_, rel_ptr<bz_node<Key, Val>>(this).rel(), 0, RELEASE_EXP_ON_SUCCESS);
-		if (!pmwcas_commit(mdesc))
-			return ERACE;
-		return 0;
+		pmwcas_add(mdesc, &tree->root_, rel_ptr<bz_node<Key, Val, Cmp>>(this).rel(), 0, RELEASE_EXP_ON_SUCCESS);
+		{
+			auto dram_guard = tree->lock_dram_index(is_leaf(length_));
+			if (!pmwcas_commit(mdesc))
+				ret = ERACE;
+			else if (tree->dram_ && is_leaf(length_))
+				tree->dram_->merge(rel_ptr<bz_node<Key, Val, Cmp>>(this).rel(), 0, 0);
+		}
+		pmwcas_free(mdesc);
+		return ret;
 	}
 
-	//freeze old parent
+	/*
+	* freeze the parent before copying it: a consolidation swaps its child
+	* pointer in place and keeps the status, a stale copy would not notice
+	*/
 	uint64_t status_parent_new = status_frozen(status_parent);
-	pmwcas_add(mdesc, &parent->status_, status_parent, status_parent_new, 0);
+	if (tree->pack_pmwcas({ { &parent->status_, status_parent, status_parent_new } })) {
+		pmwcas_free(mdesc);
+		return EFROZEN;
+	}
+	pmwcas_add(mdesc, &parent->status_, status_parent_new, status_parent, NOCAS_EXECUTE_ON_FAILED);
 
 	if (sibling_type) {
 		/* ʼN' */
 		new_node_ptr = tree->alloc_node<Val>(mdesc, 0);
-		rel_ptr<bz_node<Key, Val>> new_node = *new_node_ptr;
+		rel_ptr<bz_node<Key, Val, Cmp>> new_node = *new_node_ptr;
 
 		uint32_t new_blk_sz = 0;
 		uint32_t new_rec_cnt = 0;
 
 		//Nsiblingmetak-v
-		this->copy_node_to(new_node);
-		uint32_t tot_rec_cnt = sibling->copy_node_to(new_node);
+		uint64_t status_rd = pmwcas_read(&status_);
+		uint64_t status_sibling_rd = pmwcas_read(&sibling->status_);
+		new_node->fr_set_prefix(pick_key_prefix({
+			std::make_tuple(this, rec_meta_arr(), get_record_count(status_rd)),
+			std::make_tuple(&*sibling, sibling->rec_meta_arr(), get_record_count(status_sibling_rd)) }));
+		this->copy_node_to(new_node, status_rd, BZ_COPY_SHARED);
+		sibling->copy_node_to(new_node, status_sibling_rd, BZ_COPY_SHARED);
+		new_node->fr_close_prefix();
+		this->copy_node_to(new_node, status_rd, BZ_COPY_REST);
+		sibling->copy_node_to(new_node, status_sibling_rd, BZ_COPY_REST);
 		new_node->fr_sort_meta();
 
 		//ʼstatuslength
+		new_node->fr_build_prefixes();
 		persist(new_node.abs(), NODE_ALLOC_SIZE);
 	}
 
@@ -573,14 +940,14 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 	rel_ptr<uint64_t> sibling_addr(sibling);
 
 	if (child_max > 2 
-		|| child_max == 2 && BZ_KEY_MAX != *(uint64_t*)parent->nth_key(1)
+		|| child_max == 2 && !bz_codec<Key>::is_max(parent->nth_key(1))
 		|| new_node_ptr.is_null())
 	{
 		//׽ڵ
 		
 		/* ʼP' BEGIN */
 		new_parent_ptr = tree->alloc_node<uint64_t>(mdesc, 1);
-		rel_ptr<bz_node<Key, uint64_t>> new_parent = *new_parent_ptr;
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> new_parent = *new_parent_ptr;
 
 		uint32_t new_parent_rec_cnt = parent->copy_node_to(new_parent) - 1;
 		int pos = sibling_type < 0 ? child_id - 1 : child_id;
@@ -589,6 +956,7 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 		if (sibling_type)
 			*new_parent->nth_val(pos) = new_node_ptr->rel();
 		set_sorted_count(new_parent->length_, new_parent_rec_cnt);
+		new_parent->fr_build_prefixes();
 		persist(new_parent.abs(), NODE_ALLOC_SIZE);
 
 		//pmwcas
@@ -628,8 +996,16 @@ int bz_node<Key, Val>::merge(bz_tree<Key, TreeVal> * tree, int child_id,
 	}
 
 	//ִpmwcas
-	if (!pmwcas_commit(mdesc)) {
-		ret = ERACE;
+	{
+		/* keep the DRAM index in sync before the old leaves go to G/C */
+		auto dram_guard = tree->lock_dram_index(is_leaf(length_));
+		if (!pmwcas_commit(mdesc)) {
+			ret = ERACE;
+		}
+		else if (tree->dram_ && is_leaf(length_)) {
+			tree->dram_->merge(this_node.rel(), sibling_type ? sibling_addr.rel() : 0,
+				new_node_ptr.is_null() ? 0 : new_node_ptr->rel());
+		}
 	}
 
 IMMEDIATE_ABORT:
@@ -653,21 +1029,20 @@ split
 3. allocate 3 new nodes:
 3.1 new N' (K, k2]
 3.2 N' sibling O (k1, K]
-3.3 N' new parent P' (add new key record K and ptr to O)
-4. 3-word PMwCAS
-4.1 freeze P status
-4.2 swap G's ptr to P to P'
-4.3 G's status to detect conflicts
+3.3 N' new parent P' (freeze P, copy it, add new key record K and ptr to O)
+4. 2-word PMwCAS
+4.1 swap G's ptr to P to P'
+4.2 G's status to detect conflicts
 NOTES:
 Of new nodes, N' and O are not taken care of.
 So we need an extra PMwCAS mdesc to record those memories:
 in case failure before memory transmition, pmwcas will help reclaim;
 in case success, abort the pmwcas since it has been safe.
 */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::split(
-	bz_tree<Key, TreeVal> * tree, rel_ptr<bz_node<Key, uint64_t>> parent,
+int bz_node<Key, Val, Cmp>::split(
+	bz_tree<Key, TreeVal, Cmp> * tree, rel_ptr<bz_node<Key, uint64_t, Cmp>> parent,
 	rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr)
 {
 	/* Global Variables */
@@ -681,8 +1056,8 @@ int bz_node<Key, Val>::split(
 	print_log("SPLIT_BEGIN");
 
 	/* N'OP */
-	rel_ptr<rel_ptr<bz_node<Key, Val>>> new_left_ptr = tree->alloc_node<Val>(mdesc, 0);
-	rel_ptr<bz_node<Key, Val>> new_left = *new_left_ptr;
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>> new_left_ptr = tree->alloc_node<Val>(mdesc, 0);
+	rel_ptr<bz_node<Key, Val, Cmp>> new_left = *new_left_ptr;
 
 	/* ʼN'O BEGIN */
 	//metanew_leftֵ
@@ -696,11 +1071,11 @@ int bz_node<Key, Val>::split(
 	rel_ptr<uint64_t> this_node_addr((uint64_t*)this);
 	
 	//OP'
-	rel_ptr<rel_ptr<bz_node<Key, Val>>> new_right_ptr = tree->alloc_node<Val>(mdesc, 1);
-	rel_ptr<bz_node<Key, Val>> new_right = *new_right_ptr;
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>> new_right_ptr = tree->alloc_node<Val>(mdesc, 1);
+	rel_ptr<bz_node<Key, Val, Cmp>> new_right = *new_right_ptr;
 
-	rel_ptr<rel_ptr<bz_node<Key, uint64_t>>> new_parent_ptr = tree->alloc_node<uint64_t>(mdesc, 2);
-	rel_ptr<bz_node<Key, uint64_t>> new_parent = *new_parent_ptr;
+	rel_ptr<rel_ptr<bz_node<Key, uint64_t, Cmp>>> new_parent_ptr = tree->alloc_node<uint64_t>(mdesc, 2);
+	rel_ptr<bz_node<Key, uint64_t, Cmp>> new_parent = *new_parent_ptr;
 
 	//մСƽֵ
 	uint32_t left_rec_cnt = this->fr_get_balanced_count(new_left);
@@ -712,6 +1087,8 @@ int bz_node<Key, Val>::split(
 	//metanew_right
 	memcpy(new_right->rec_meta_arr(), new_left->rec_meta_arr() + left_rec_cnt,
 		right_rec_cnt * sizeof(uint64_t));
+	new_left->fr_set_prefix(pick_key_prefix({ std::make_tuple(this, new_left->rec_meta_arr(), left_rec_cnt) }));
+	new_right->fr_set_prefix(pick_key_prefix({ std::make_tuple(this, new_right->rec_meta_arr(), right_rec_cnt) }));
 	//k-v payload
 	uint32_t left_blk_sz = this->copy_payload_to(new_left, left_rec_cnt);
 	uint32_t right_blk_sz = this->copy_payload_to(new_right, right_rec_cnt);
@@ -719,15 +1096,18 @@ int bz_node<Key, Val>::split(
 	this->init_header(new_left, left_rec_cnt, left_blk_sz);
 	this->init_header(new_right, right_rec_cnt, right_blk_sz);
 	//־û
+	new_left->fr_build_prefixes();
 	persist(new_left.abs(), NODE_ALLOC_SIZE);
+	new_right->fr_build_prefixes();
 	persist(new_right.abs(), NODE_ALLOC_SIZE);
 	/* ʼ N'O END */
 
 	/* ʼP' BEGIN */
 	//÷ֵָK
 	uint64_t meta_key = new_left->rec_meta_arr()[left_rec_cnt - 1];
-	const Key * K = new_left->get_key(meta_key);
-	uint32_t key_sz = get_key_length(meta_key);
+	std::string sep_buf;
+	uint32_t key_sz;
+	const Key * K = new_left->separator_key(meta_key, new_right, new_right->rec_meta_arr()[0], sep_buf, key_sz);
 	uint32_t tot_sz = key_sz + sizeof(uint64_t);
 	uint64_t V = new_left.rel();
 	uint64_t * parent_meta_arr = new_parent->rec_meta_arr();
@@ -739,17 +1119,26 @@ int bz_node<Key, Val>::split(
 			ret = EFROZEN;
 			goto IMMEDIATE_ABORT;
 		}
+		/* freeze P before copying it, see merge() */
+		uint64_t status_parent_new = status_frozen(status_parent_rd);
+		if (tree->pack_pmwcas({ { &parent->status_, status_parent_rd, status_parent_new } })) {
+			ret = EFROZEN;
+			goto IMMEDIATE_ABORT;
+		}
+		pmwcas_add(mdesc, &parent->status_, status_parent_new, status_parent_rd, NOCAS_EXECUTE_ON_FAILED);
 
 		uint32_t new_parent_rec_cnt = parent->copy_node_to(new_parent, status_parent_rd);
 		if (ret = new_parent->fr_insert_meta(K, V, key_sz, new_right.rel()))
 			goto IMMEDIATE_ABORT;
 		//־û
+		new_parent->fr_build_prefixes();
 		persist(new_parent.abs(), NODE_ALLOC_SIZE);
 	}
 	else {
 		/* ǰڵǸڵ */
 		if (ret = new_parent->fr_root_init(K, V, key_sz, new_right.rel()))
 			goto IMMEDIATE_ABORT;
+		new_parent->fr_build_prefixes();
 		persist(new_parent.abs(), NODE_ALLOC_SIZE);
 	}
 	/* ʼP' END */
@@ -759,11 +1148,7 @@ int bz_node<Key, Val>::split(
 		/* 游ڵ */
 		//3.1 G's ptr to P -> P'
 		pmwcas_add(mdesc, grandpa_ptr, parent.rel(), new_parent.rel(), RELEASE_EXP_ON_SUCCESS);
-		//3.2 freeze P's status
-		uint64_t status_parent_new = status_frozen(status_parent_rd);
-		
-		pmwcas_add(mdesc, &parent->status_, status_parent_rd, status_parent_new);
-		//3.3 make sure G's status is not frozen
+		//3.2 make sure G's status is not frozen
 		uint64_t status_grandpa_rd = pmwcas_read(grandpa_status.abs());
 		if (is_frozen(status_grandpa_rd)) {
 			ret = EFROZEN;
@@ -776,20 +1161,23 @@ int bz_node<Key, Val>::split(
 		/* ڵǸڵ */
 		//3.1 root's ptr to P -> P'
 		pmwcas_add(mdesc, &tree->root_, parent.rel(), new_parent.rel(), RELEASE_EXP_ON_SUCCESS);
-		//3.2 freeze P's status
-		uint64_t status_parent_new = status_frozen(status_parent_rd);
-		pmwcas_add(mdesc, &parent->status_, status_parent_rd, status_parent_new);
 		pmwcas_add(mdesc, this_node_addr, 0, 0, NOCAS_RELEASE_ADDR_ON_SUCCESS);
 	}
 	else {
 		/* ǰڵǸڵ */
-		rel_ptr<bz_node<Key, Val>> cur_ptr = this;
+		rel_ptr<bz_node<Key, Val, Cmp>> cur_ptr = this;
 		pmwcas_add(mdesc, &tree->root_, cur_ptr.rel(), new_parent.rel(), RELEASE_EXP_ON_SUCCESS);
 	}
 
 	//ִpmwcas
-	if (!pmwcas_commit(mdesc)) {
-		ret = ERACE;
+	{
+		auto dram_guard = tree->lock_dram_index(is_leaf(length_));
+		if (!pmwcas_commit(mdesc)) {
+			ret = ERACE;
+		}
+		else if (tree->dram_ && is_leaf(length_)) {
+			tree->dram_->split(this_node_addr.rel(), K, key_sz, new_left.rel(), new_right.rel());
+		}
 	}
 
 IMMEDIATE_ABORT:
@@ -829,9 +1217,9 @@ P's status => detect concurrent freeze
 5) N is ready for gc
 6)
 */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::consolidate(bz_tree<Key, TreeVal> * tree,
+int bz_node<Key, Val, Cmp>::consolidate(bz_tree<Key, TreeVal, Cmp> * tree,
 	rel_ptr<uint64_t> parent_status, rel_ptr<uint64_t> parent_ptr)
 {
 	int ret = 0;
@@ -843,14 +1231,19 @@ int bz_node<Key, Val>::consolidate(bz_tree<Key, TreeVal> * tree,
 	print_log("CONSOLIDATE_BEGIN");
 
 	//ʼڵΪ0
-	rel_ptr<rel_ptr<bz_node<Key, Val>>> node_ptr = tree->alloc_node<Val>(mdesc);
-	rel_ptr<bz_node<Key, Val>> node = *node_ptr;
-	this->copy_node_to(node);
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>> node_ptr = tree->alloc_node<Val>(mdesc);
+	rel_ptr<bz_node<Key, Val, Cmp>> node = *node_ptr;
+	uint64_t status_rd = pmwcas_read(&status_);
+	node->fr_set_prefix(pick_key_prefix({ std::make_tuple(this, rec_meta_arr(), get_record_count(status_rd)) }));
+	this->copy_node_to(node, status_rd, BZ_COPY_SHARED);
+	node->fr_close_prefix();
+	this->copy_node_to(node, status_rd, BZ_COPY_REST);
 	node->fr_sort_meta();
 	//־û
+	node->fr_build_prefixes();
 	persist(node.abs(), NODE_ALLOC_SIZE);
 
-	rel_ptr<bz_node<Key, Val>> this_node(this);
+	rel_ptr<bz_node<Key, Val, Cmp>> this_node(this);
 
 	//Ҫ޸ĸڵ㣬ȷFrozen != 0
 	if (!parent_ptr.is_null()) {
@@ -867,8 +1260,13 @@ int bz_node<Key, Val>::consolidate(bz_tree<Key, TreeVal> * tree,
 	}
 
 	//ִpmwcas
-	if (!pmwcas_commit(mdesc))
-		ret = ERACE;
+	{
+		auto dram_guard = tree->lock_dram_index(is_leaf(length_));
+		if (!pmwcas_commit(mdesc))
+			ret = ERACE;
+		else if (tree->dram_ && is_leaf(length_))
+			tree->dram_->replace(this_node.rel(), node.rel());
+	}
 
 IMMEDIATE_ABORT:
 	pmwcas_free(mdesc);
@@ -881,8 +1279,8 @@ IMMEDIATE_ABORT:
 	return ret;
 }
 /* ڵʱڵ̵߳ */
-template<typename Key, typename Val>
-uint32_t bz_node<Key, Val>::fr_get_balanced_count(rel_ptr<bz_node<Key, Val>> dst)
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::fr_get_balanced_count(rel_ptr<bz_node<Key, Val, Cmp>> dst)
 {
 	uint32_t old_blk_sz = valid_block_size();
 	uint64_t * meta_arr = dst->rec_meta_arr();
@@ -897,8 +1295,13 @@ uint32_t bz_node<Key, Val>::fr_get_balanced_count(rel_ptr<bz_node<Key, Val>> dst
 }
 
 
-template<typename Key, typename Val>
-uint32_t bz_node<Key, Val>::copy_node_to(rel_ptr<bz_node<Key, Val>> dst, uint64_t status_rd)
+/*
+* append the visible records to @param dst, those sharing its prefix stripped of it;
+* a compressed copy goes in two steps, @param part BZ_COPY_SHARED then BZ_COPY_REST,
+* with fr_close_prefix in between
+*/
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::copy_node_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint64_t status_rd, int part)
 {
 	if (!status_rd)
 		status_rd = pmwcas_read(&status_);
@@ -907,30 +1310,25 @@ uint32_t bz_node<Key, Val>::copy_node_to(rel_ptr<bz_node<Key, Val>> dst, uint64_
 	uint32_t rec_cnt = get_record_count(status_rd);
 	uint32_t new_rec_cnt = get_record_count(dst->status_);
 	uint32_t new_blk_sz = get_block_size(dst->status_);
-	uint32_t new_node_sz = get_node_size(dst->length_);
+	const uint8_t * pfx = dst->key_prefix();
+	uint32_t p = dst->cpfx_len_;
+	/* the copies of the sorted region stay in order, only the ones after tail_beg are not */
+	uint32_t sorted_cnt = std::min(get_sorted_count(length_), rec_cnt);
+	uint32_t run_beg = new_rec_cnt, tail_beg = new_rec_cnt;
 	for (uint32_t i = 0; i < rec_cnt; ++i) {
 		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
 		if (is_visiable(meta_rd)) {
-			const Key * key = get_key(meta_rd);
-			const Val * val = get_value(meta_rd);
-
-			//assert(*(uint64_t*)key < 65 || *(uint64_t*)key == BZ_KEY_MAX);
-			uint64_t tmp = *(uint64_t*)val;
-			if ((tmp & MwCAS_BIT || tmp & RDCSS_BIT || tmp & DIRTY_BIT)) {
-				std::this_thread::sleep_for(std::chrono::milliseconds(1));
-				uint64_t tt = *(uint64_t*)val;
-				assert(0);
-			}
-
-			uint32_t key_sz = get_key_length(meta_rd);
-			uint32_t tot_sz = get_total_length(meta_rd);
-			uint32_t offset = new_node_sz - new_blk_sz - tot_sz - 1;
-			new_meta_arr[new_rec_cnt] = meta_vis_off_klen_tlen(0, true, offset, key_sz, tot_sz);
-			dst->copy_data(offset, key, val, key_sz, tot_sz);
-			new_blk_sz += tot_sz;
+			bool strip = p && shares_prefix(meta_rd, pfx, p);
+			if ((part == BZ_COPY_SHARED && !strip) || (part == BZ_COPY_REST && strip))
+				continue;
+			new_meta_arr[new_rec_cnt] = copy_record_to(dst, meta_rd, new_blk_sz, strip);
+			new_blk_sz += get_total_length(new_meta_arr[new_rec_cnt]);
 			++new_rec_cnt;
+			if (i < sorted_cnt)
+				tail_beg = new_rec_cnt;
 		}
 	}
+	dst->sort_meta_tail(new_meta_arr + run_beg, tail_beg - run_beg, new_rec_cnt - run_beg);
 	set_record_count(dst->status_, new_rec_cnt);
 	set_block_size(dst->status_, new_blk_sz);
 	if (is_leaf(length_)) {
@@ -942,21 +1340,43 @@ uint32_t bz_node<Key, Val>::copy_node_to(rel_ptr<bz_node<Key, Val>> dst, uint64_
 	return new_rec_cnt;
 }
 
-template<typename Key, typename Val>
-void bz_node<Key, Val>::fr_sort_meta()
+/* the copies into a new node are sorted runs, one per copy_node_to: find and merge them */
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::fr_sort_meta()
 {
-	uint64_t tot_rec_cnt = get_record_count(status_);
+	uint32_t tot_rec_cnt = get_record_count(status_);
 	uint64_t * new_meta_arr = rec_meta_arr();
-	std::sort(new_meta_arr, new_meta_arr + tot_rec_cnt,
-		std::bind(&bz_node<Key, Val>::key_cmp_meta, this, std::placeholders::_1, std::placeholders::_2));
+	auto less = std::bind(&bz_node<Key, Val, Cmp>::key_cmp_meta, this, std::placeholders::_1, std::placeholders::_2);
+	std::vector<uint32_t> bounds(1, 0);
+	for (uint32_t i = 1; i < tot_rec_cnt; ++i) {
+		if (less(new_meta_arr[i], new_meta_arr[i - 1]))
+			bounds.push_back(i);
+	}
+	bounds.push_back(tot_rec_cnt);
+	merge_meta_k_runs(new_meta_arr, bounds.data(), (uint32_t)bounds.size() - 1, less);
 	//ЧmetaĿ
 	uint32_t new_rec_cnt = binary_search(nullptr, (int)tot_rec_cnt);
 	set_sorted_count(length_, new_rec_cnt);
 	set_record_count(status_, new_rec_cnt);
 }
 
-template<typename Key, typename Val>
-inline void bz_node<Key, Val>::fr_remove_meta(int pos)
+/*
+* sort @param metas[@param sorted_cnt, @param cnt), meta entries of this node, and merge
+* them into the sorted run metas[0, sorted_cnt)
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::sort_meta_tail(uint64_t * metas, uint32_t sorted_cnt, uint32_t cnt)
+{
+	if (sorted_cnt == cnt)
+		return;
+	auto less = std::bind(&bz_node<Key, Val, Cmp>::key_cmp_meta, this, std::placeholders::_1, std::placeholders::_2);
+	std::vector<uint64_t> tail(metas + sorted_cnt, metas + cnt);
+	std::sort(tail.begin(), tail.end(), less);
+	merge_meta_runs(metas, sorted_cnt, tail.data(), (uint32_t)tail.size(), less);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline void bz_node<Key, Val, Cmp>::fr_remove_meta(int pos)
 {
 	uint64_t * parent_meta_arr = rec_meta_arr();
 	uint32_t rec_cnt = get_record_count(status_);
@@ -967,8 +1387,8 @@ inline void bz_node<Key, Val>::fr_remove_meta(int pos)
 	set_delete_size(status_, dele_sz + get_total_length(parent_meta_arr[pos]));
 }
 
-template<typename Key, typename Val>
-inline int bz_node<Key, Val>::fr_insert_meta(const Key * K, uint64_t left, uint32_t key_sz, uint64_t right)
+template<typename Key, typename Val, typename Cmp>
+inline int bz_node<Key, Val, Cmp>::fr_insert_meta(const Key * K, uint64_t left, uint32_t key_sz, uint64_t right)
 {
 	uint64_t * meta_arr = rec_meta_arr();
 	uint32_t tot_sz = key_sz + sizeof(uint64_t);
@@ -980,7 +1400,7 @@ inline int bz_node<Key, Val>::fr_insert_meta(const Key * K, uint64_t left, uint3
 		return EALLOCSIZE;
 	}
 	memmove(meta_arr + pos + 1, meta_arr + pos, sizeof(uint64_t) * (rec_cnt - pos));
-	uint32_t key_offset = node_sz - blk_sz - tot_sz - 1;
+	uint32_t key_offset = node_sz - blk_sz - tot_sz;
 	meta_arr[pos] = meta_vis_off_klen_tlen(0, true, key_offset, key_sz, tot_sz);
 	this->copy_data(key_offset, K, &left, key_sz, tot_sz);
 	//޸ԭָNָ룬ָnew_right
@@ -992,8 +1412,8 @@ inline int bz_node<Key, Val>::fr_insert_meta(const Key * K, uint64_t left, uint3
 	return 0;
 }
 
-template<typename Key, typename Val>
-int bz_node<Key, Val>::fr_root_init(const Key * K, uint64_t left, uint32_t key_sz, uint64_t right)
+template<typename Key, typename Val, typename Cmp>
+int bz_node<Key, Val, Cmp>::fr_root_init(const Key * K, uint64_t left, uint32_t key_sz, uint64_t right)
 {
 	uint64_t * meta_arr = rec_meta_arr();
 	uint32_t node_sz = get_node_size(length_);
@@ -1001,14 +1421,14 @@ int bz_node<Key, Val>::fr_root_init(const Key * K, uint64_t left, uint32_t key_s
 	if (node_sz < sizeof(*this) + sizeof(uint64_t) * 2 - tot_sz * 2)
 		return EALLOCSIZE;
 
-	uint32_t left_key_offset = node_sz - tot_sz - 1;
+	uint32_t left_key_offset = node_sz - tot_sz;
 	meta_arr[0] = meta_vis_off_klen_tlen(0, true, left_key_offset, key_sz, tot_sz);
 	copy_data(left_key_offset, K, &left, key_sz, tot_sz);
 
 	//P'<BZ_KEY_MAX, new_right>
 	uint32_t right_key_offset = left_key_offset - sizeof(uint64_t) * 2;
 	meta_arr[1] = meta_vis_off_klen_tlen(0, true, right_key_offset, sizeof(uint64_t), sizeof(uint64_t) * 2);
-	*(uint64_t*)get_key(meta_arr[1]) = BZ_KEY_MAX;
+	bz_set_key_max(get_key(meta_arr[1]));
 	*(uint64_t*)get_value(meta_arr[1]) = right;
 
 	//ʼstatuslength
@@ -1019,26 +1439,81 @@ int bz_node<Key, Val>::fr_root_init(const Key * K, uint64_t left, uint32_t key_s
 	return 0;
 }
 
+/*
+* append a record greater than every present one to a node under construction
+* @param limit: bytes the node may fill, header included
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_node<Key, Val, Cmp>::fr_append_meta(const Key * key, const Val * val, uint32_t key_sz, uint32_t tot_sz, uint32_t limit)
+{
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t rec_cnt = get_record_count(status_);
+	uint32_t blk_sz = get_block_size(status_);
+	uint32_t node_sz = get_node_size(length_);
+	uint32_t new_sz = sizeof(*this) + (rec_cnt + 1) * sizeof(uint64_t) + blk_sz + tot_sz;
+	if (new_sz >= node_sz || (rec_cnt && new_sz > limit))
+		return EALLOCSIZE;
+	uint32_t offset = node_sz - blk_sz - tot_sz;
+	meta_arr[rec_cnt] = meta_vis_off_klen_tlen(0, true, offset, key_sz, tot_sz);
+	copy_data(offset, key, val, key_sz, tot_sz);
+	set_record_count(status_, rec_cnt + 1);
+	set_sorted_count(length_, rec_cnt + 1);
+	set_block_size(status_, blk_sz + tot_sz);
+	return 0;
+}
+
+/*
+* store the key prefixes of the sorted region in the block, single thread on a new node;
+* skipped when they would leave the node due for a consolidate
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::fr_build_prefixes()
+{
+	prefix_off_ = 0;
+#ifndef BZ_NO_KEY_PREFIX
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t sorted_cnt = get_sorted_count(length_);
+	uint32_t rec_cnt = get_record_count(status_);
+	uint32_t blk_sz = get_block_size(status_);
+	uint32_t node_sz = get_node_size(length_);
+	uint32_t prefix_sz = sorted_cnt * sizeof(uint64_t);
+	uint32_t free_sz = node_sz - blk_sz - sizeof(*this) - rec_cnt * sizeof(uint64_t);
+	if (!Cmp::has_prefix || !sorted_cnt || free_sz <= prefix_sz + sizeof(uint64_t) - 1 + NODE_MIN_FREE_SIZE)
+		return;
+	/* variable-size records leave the block end unaligned: pad the array down to 8 bytes */
+	uint32_t offset = (node_sz - blk_sz - prefix_sz) & ~(uint32_t)(sizeof(uint64_t) - 1);
+	uint64_t * prefixes = (uint64_t*)((char*)this + offset);
+	std::string buf;
+	for (uint32_t i = 0; i < sorted_cnt; ++i)
+		prefixes[i] = bz_key_prefix<Key, Cmp>()(full_key(meta_arr[i], buf));
+	set_block_size(status_, node_sz - offset);
+	prefix_off_ = offset;
+#endif // !BZ_NO_KEY_PREFIX
+}
+
 
 /* ӵǰڵ㿽metadstڵ㣬ռֵͿɼ򣬷 */
-template<typename Key, typename Val>
-uint32_t bz_node<Key, Val>::copy_sort_meta_to(rel_ptr<bz_node<Key, Val>> dst)
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::copy_sort_meta_to(rel_ptr<bz_node<Key, Val, Cmp>> dst)
 {
 	//metaֵ
 	uint64_t * new_meta_arr = dst->rec_meta_arr();
 	uint64_t * old_meta_arr = rec_meta_arr();
 	uint64_t status_rd = pmwcas_read(&status_);
-	uint64_t rec_cnt = get_record_count(status_rd);
+	uint32_t rec_cnt = get_record_count(status_rd);
+	uint32_t sorted_cnt = std::min(get_sorted_count(length_), rec_cnt);
 	uint32_t new_rec_cnt = get_record_count(dst->status_);
+	uint32_t run_beg = new_rec_cnt, tail_beg = new_rec_cnt;
 	for (uint32_t i = 0; i < rec_cnt; ++i) {
 		uint64_t meta_rd = pmwcas_read(&old_meta_arr[i]);
 		if (is_visiable(meta_rd)) {
 			new_meta_arr[new_rec_cnt] = meta_rd;
 			++new_rec_cnt;
+			if (i < sorted_cnt)
+				tail_beg = new_rec_cnt;
 		}
 	}
-	std::sort(new_meta_arr, new_meta_arr + new_rec_cnt,
-		std::bind(&bz_node<Key, Val>::key_cmp_meta, this, std::placeholders::_1, std::placeholders::_2));
+	sort_meta_tail(new_meta_arr + run_beg, tail_beg - run_beg, new_rec_cnt - run_beg);
 	//ЧmetaĿ
 	return this->binary_search(nullptr, new_rec_cnt, new_meta_arr);
 	//ʣಿÿ
@@ -1046,32 +1521,36 @@ uint32_t bz_node<Key, Val>::copy_sort_meta_to(rel_ptr<bz_node<Key, Val>> dst)
 	//return new_rec_cnt;
 }
 /* key-value زblockС */
-template<typename Key, typename Val>
-uint32_t bz_node<Key, Val>::copy_payload_to(rel_ptr<bz_node<Key, Val>> dst, uint32_t new_rec_cnt)
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::copy_payload_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint32_t new_rec_cnt)
 {
-	uint32_t blk_sz = 0;
-	uint32_t node_sz = NODE_ALLOC_SIZE;
 	uint64_t * new_meta_arr = dst->rec_meta_arr();
+	/* the records sharing the dst prefix go first, stripped of it, then the others in full */
+	const uint8_t * pfx = dst->key_prefix();
+	uint32_t p = dst->cpfx_len_;
+	uint32_t shared_sz = 0;
+	for (uint32_t i = 0; p && i < new_rec_cnt; ++i) {
+		if (shares_prefix(new_meta_arr[i], pfx, p))
+			shared_sz += full_key_length(new_meta_arr[i]) - p
+				+ get_total_length(new_meta_arr[i]) - get_key_length(new_meta_arr[i]);
+	}
+	if (!shared_sz)
+		dst->cpfx_len_ = p = 0;
+	uint32_t shared_blk = p;
+	uint32_t blk_sz = p + shared_sz;
+	if (p)
+		dst->cpfx_off_ = NODE_ALLOC_SIZE - blk_sz;
 	for (uint32_t i = 0; i < new_rec_cnt; ++i) {
-		const Key * key = get_key(new_meta_arr[i]);
-		const Val * val = get_value(new_meta_arr[i]);
-
-		//assert(*(uint64_t*)key < 65 || *(uint64_t*)key == BZ_KEY_MAX);
-		uint64_t tmp = *(uint64_t*)val;
-		assert(!(tmp & MwCAS_BIT || tmp & DIRTY_BIT || tmp & RDCSS_BIT));
-
-		uint32_t key_sz = get_key_length(new_meta_arr[i]);
-		uint32_t tot_sz = get_total_length(new_meta_arr[i]);
-		uint32_t new_offset = node_sz - blk_sz - tot_sz - 1;
-		new_meta_arr[i] = meta_vis_off_klen_tlen(0, true, new_offset, key_sz, tot_sz);
-		dst->copy_data(new_offset, key, val, key_sz, tot_sz);
-		blk_sz += tot_sz;
+		bool strip = p && shares_prefix(new_meta_arr[i], pfx, p);
+		uint32_t & at = strip ? shared_blk : blk_sz;
+		new_meta_arr[i] = copy_record_to(dst, new_meta_arr[i], at, strip);
+		at += get_total_length(new_meta_arr[i]);
 	}
 	return blk_sz;
 }
 /* ݲʼstatuslength̵߳ */
-template<typename Key, typename Val>
-void bz_node<Key, Val>::init_header(rel_ptr<bz_node<Key, Val>> dst, uint32_t new_rec_cnt, uint32_t blk_sz, int leaf_opt, uint32_t dele_sz)
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::init_header(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint32_t new_rec_cnt, uint32_t blk_sz, int leaf_opt, uint32_t dele_sz)
 {
 	dst->status_ = 0ULL;
 	set_record_count(dst->status_, new_rec_cnt);
@@ -1091,8 +1570,8 @@ void bz_node<Key, Val>::init_header(rel_ptr<bz_node<Key, Val>> dst, uint32_t new
 	set_sorted_count(dst->length_, new_rec_cnt);
 }
 
-template<typename Key, typename Val>
-inline uint32_t bz_node<Key, Val>::valid_block_size(uint64_t status_rd)
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_node<Key, Val, Cmp>::valid_block_size(uint64_t status_rd)
 {
 	if (!status_rd) {
 		status_rd = pmwcas_read(&status_);
@@ -1108,8 +1587,9 @@ inline uint32_t bz_node<Key, Val>::valid_block_size(uint64_t status_rd)
 	return tot_sz;
 }
 
-template<typename Key, typename Val>
-inline uint32_t bz_node<Key, Val>::valid_node_size(uint64_t status_rd)
+/* @param full: stripped keys counted at their full length, without the node prefix */
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_node<Key, Val, Cmp>::valid_node_size(uint64_t status_rd, bool full)
 {
 	if (!status_rd) {
 		status_rd = pmwcas_read(&status_);
@@ -1122,14 +1602,16 @@ inline uint32_t bz_node<Key, Val>::valid_node_size(uint64_t status_rd)
 		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
 		if (is_visiable(meta_rd)) {
 			tot_sz += get_total_length(meta_rd);
+			if (full && key_stripped(meta_rd))
+				tot_sz += cpfx_len_;
 			++tot_rec_cnt;
 		}
 	}
 	return sizeof(*this) + sizeof(uint64_t) * tot_rec_cnt + tot_sz;
 }
 
-template<typename Key, typename Val>
-inline uint32_t bz_node<Key, Val>::valid_record_count(uint64_t status_rd)
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_node<Key, Val, Cmp>::valid_record_count(uint64_t status_rd)
 {
 	if (!status_rd) {
 		status_rd = pmwcas_read(&status_);
@@ -1146,9 +1628,9 @@ inline uint32_t bz_node<Key, Val>::valid_record_count(uint64_t status_rd)
 	return tot_rec_cnt;
 }
 
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-mdesc_t bz_node<Key, Val>::try_freeze(bz_tree<Key, TreeVal> * tree)
+mdesc_t bz_node<Key, Val, Cmp>::try_freeze(bz_tree<Key, TreeVal, Cmp> * tree)
 {
 	while (true) {
 		uint64_t status_rd = pmwcas_read(&status_);
@@ -1163,12 +1645,15 @@ mdesc_t bz_node<Key, Val>::try_freeze(bz_tree<Key, TreeVal> * tree)
 		if (!ret)
 			return mdesc;
 		pmwcas_abort(mdesc);
+		/* out of descriptors: back off out of the critical section, the G/C refills the pool */
+		if (ret == EPMWCASALLOC)
+			return mdesc_t::null();
 	}
 }
 
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-inline bool bz_node<Key, Val>::unfreeze(bz_tree<Key, TreeVal> * tree)
+inline bool bz_node<Key, Val, Cmp>::unfreeze(bz_tree<Key, TreeVal, Cmp> * tree)
 {
 	uint64_t status_rd = pmwcas_read(&status_);
 	uint64_t status_unfrozen = status_rd;
@@ -1176,8 +1661,8 @@ inline bool bz_node<Key, Val>::unfreeze(bz_tree<Key, TreeVal> * tree)
 	return !tree->pack_pmwcas({ { &status_, status_rd, status_unfrozen } });
 }
 
-template<typename Key, typename Val>
-inline rel_ptr<uint64_t> bz_node<Key, Val>::nth_child(int n)
+template<typename Key, typename Val, typename Cmp>
+inline rel_ptr<uint64_t> bz_node<Key, Val, Cmp>::nth_child(int n)
 {
 	if (n < 0)
 		return rel_ptr<uint64_t>::null();
@@ -1185,57 +1670,48 @@ inline rel_ptr<uint64_t> bz_node<Key, Val>::nth_child(int n)
 	return rel_ptr<uint64_t>(*nth_val(n));
 }
 
-template<typename Key, typename Val>
-inline Key * bz_node<Key, Val>::nth_key(int n)
+template<typename Key, typename Val, typename Cmp>
+inline Key * bz_node<Key, Val, Cmp>::nth_key(int n)
 {
 	if (n < 0)
 		return nullptr;
 	return get_key(pmwcas_read(rec_meta_arr() + n));
 }
 
-template<typename Key, typename Val>
-inline Val * bz_node<Key, Val>::nth_val(int n)
+template<typename Key, typename Val, typename Cmp>
+inline Val * bz_node<Key, Val, Cmp>::nth_val(int n)
 {
 	if (n < 0)
 		return nullptr;
 	return get_value(pmwcas_read(rec_meta_arr() + n));
 }
 
-template<typename Key, typename Val>
-void bz_node<Key, Val>::print_log(const char * action, const Key * k, uint64_t ret, bool pr)
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::print_log(const char * action, const Key * k, uint64_t ret, bool pr)
 {
 	if (!pr)
 		return;
 	mylock.lock();
-	fs << "<" << hex << rel_ptr<bz_node<Key, Val>>(this).rel() << "> ";
-	if (typeid(Key) == typeid(char)) {
-		fs << "[" << this_thread::get_id() << "] " << " ";
-		fs << action;
-		if (k)
-			fs << " key " << k;
-		if (ret != -1)
-			fs << " : " << ret;
-		fs << endl;
-	}
-	else {
-		fs << "[" << this_thread::get_id() << "] ";
-		fs << action;
-		if (k)
-			fs << " key " << *k;
-		if (ret != -1)
-			fs << " : " << ret;
-		fs << endl;
+	fs << "<" << hex << rel_ptr<bz_node<Key, Val, Cmp>>(this).rel() << "> ";
+	fs << "[" << this_thread::get_id() << "] ";
+	fs << action;
+	if (k) {
+		fs << " key ";
+		bz_codec<Key>::print(fs, k);
 	}
+	if (ret != -1)
+		fs << " : " << ret;
+	fs << endl;
 	mylock.unlock();
 }
 
-template<typename Key, typename Val>
-void bz_tree<Key, Val>::print_dfs(uint64_t ptr, int level)
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::print_dfs(uint64_t ptr, int level)
 {
 	if (!ptr)
 		return;
 	bool isLeaf = is_leaf_node(ptr);
-	rel_ptr<bz_node<Key, Val>> node(ptr);
+	rel_ptr<bz_node<Key, Val, Cmp>> node(ptr);
 	uint64_t * meta_arr = node->rec_meta_arr();
 	uint32_t rec_cnt = get_record_count(node->status_);
 	fs << hex << ptr;
@@ -1247,13 +1723,11 @@ void bz_tree<Key, Val>::print_dfs(uint64_t ptr, int level)
 		if (!is_visiable(meta_arr[i]))
 			continue;
 		if (isLeaf) {
+			std::string buf;
 			fs << "(";
-			if (typeid(Key) == typeid(char))
-				fs << (char*)node->get_key(meta_arr[i]);
-			else
-				fs << *node->get_key(meta_arr[i]);
+			bz_codec<Key>::print(fs, node->full_key(meta_arr[i], buf));
 			fs << ",";
-			if (typeid(Val) == typeid(rel_ptr<char>))
+			if (std::is_same<Val, rel_ptr<char>>::value)
 				fs << (char*)(*node->get_value(meta_arr[i])).abs();
 			else {
 				rel_ptr<uint64_t> *p = node->get_value(meta_arr[i]);
@@ -1266,11 +1740,9 @@ void bz_tree<Key, Val>::print_dfs(uint64_t ptr, int level)
 			}
 			fs << ") ";
 		}
-		else if (*(uint64_t*)node->get_key(meta_arr[i]) != BZ_KEY_MAX) {
-			if (typeid(Key) == typeid(char))
-				fs << (char*)node->get_key(meta_arr[i]) << " ";
-			else
-				fs << *node->get_key(meta_arr[i]) << " ";
+		else if (!bz_codec<Key>::is_max(node->get_key(meta_arr[i]))) {
+			bz_codec<Key>::print(fs, node->get_key(meta_arr[i]));
+			fs << " ";
 		}
 		else {
 			fs << "KEY_MAX";
@@ -1284,10 +1756,10 @@ void bz_tree<Key, Val>::print_dfs(uint64_t ptr, int level)
 	}
 }
 
-template<typename Key, typename Val>
-inline mdesc_t bz_tree<Key, Val>::alloc_mdesc(int recycle)
+template<typename Key, typename Val, typename Cmp>
+inline mdesc_t bz_tree<Key, Val, Cmp>::alloc_mdesc(int recycle)
 {
-	int max_retry = 100;
+	int max_retry = 10;
 	int retry = 0;
 	mdesc_t mdesc = pmwcas_alloc(&pool_, recycle);
 	while (mdesc.is_null() && retry < max_retry) {
@@ -1297,18 +1769,63 @@ inline mdesc_t bz_tree<Key, Val>::alloc_mdesc(int recycle)
 	return mdesc;
 }
 
-template<typename Key, typename Val>
-inline void bz_tree<Key, Val>::recycle_node(rel_ptr<rel_ptr<uint64_t>> ptr)
+template<typename Key, typename Val, typename Cmp>
+inline void bz_tree<Key, Val, Cmp>::recycle_node(rel_ptr<rel_ptr<uint64_t>> ptr)
 {
 	pmwcas_word_recycle(&pool_, ptr);
 }
 
-template<typename Key, typename Val>
-inline void bz_tree<Key, Val>::print_node(uint64_t ptr, int extra)
+/*
+* allocate a node for the bulk loader and record it in @param nodes
+* the allocations are batched WORD_DESCRIPTOR_SIZE per @param mdesc,
+* a full descriptor is committed so that its nodes are kept
+*/
+template<typename Key, typename Val, typename Cmp>
+template<typename NType>
+rel_ptr<bz_node<Key, NType, Cmp>> bz_tree<Key, Val, Cmp>::bulk_alloc(mdesc_t & mdesc, std::vector<uint64_t> & nodes)
+{
+	if (!mdesc.is_null() && mdesc->count == WORD_DESCRIPTOR_SIZE) {
+		pmwcas_commit(mdesc);
+		pmwcas_free(mdesc);
+		mdesc = mdesc_t::null();
+	}
+	if (mdesc.is_null()) {
+		mdesc = alloc_mdesc();
+		if (mdesc.is_null())
+			return rel_ptr<bz_node<Key, NType, Cmp>>::null();
+	}
+	rel_ptr<bz_node<Key, NType, Cmp>> node = *alloc_node<NType>(mdesc, (int)mdesc->count);
+	nodes.push_back(node.rel());
+	return node;
+}
+
+/*
+* release the nodes of an abandoned bulk load right away, no thread has seen them
+* each one passes through a reserved word, so that a crash in between
+* leaves it to the recovery of the undecided descriptor
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::bulk_release(const std::vector<uint64_t> & nodes)
+{
+	mdesc_t mdesc = alloc_mdesc();
+	if (mdesc.is_null())
+		return;
+	rel_ptr<rel_ptr<uint64_t>> slot = pmwcas_reserve<uint64_t>(mdesc,
+		get_magic(&pool_, 0), rel_ptr<uint64_t>::null(), NOCAS_RELEASE_NEW_ON_FAILED);
+	for (uint64_t ptr : nodes) {
+		*slot = rel_ptr<uint64_t>(ptr);
+		persist(slot.abs(), sizeof(uint64_t));
+		recycle_node(slot);
+	}
+	pmwcas_abort(mdesc);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline void bz_tree<Key, Val, Cmp>::print_node(uint64_t ptr, int extra)
 {
 	mylock.lock();
 	fs << "extra " << ptr << " [" << this_thread::get_id() << "] ";
-	rel_ptr<bz_node<Key, Val>> node(ptr);
+	rel_ptr<bz_node<Key, Val, Cmp>> node(ptr);
 	uint64_t status_rd = pmwcas_read(&node->status_);
 	uint64_t length = node->length_;
 	fs << std::setfill('0') << std::hex << std::setw(16) << status_rd << " ";
@@ -1319,12 +1836,11 @@ inline void bz_tree<Key, Val>::print_node(uint64_t ptr, int extra)
 		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
 		fs << meta_rd << " ";
 		if (is_visiable(meta_rd)) {
-			const Key * key = node->get_key(meta_rd);
-			if (*(uint64_t*)key != BZ_KEY_MAX) {
-				if (typeid(Key) == typeid(char))
-					fs << (char*)key << " ";
-				else
-					fs << *key << " ";
+			std::string buf;
+			const Key * key = node->full_key(meta_rd, buf);
+			if (!bz_codec<Key>::is_max(key)) {
+				bz_codec<Key>::print(fs, key);
+				fs << " ";
 			}
 			else {
 				fs << "KEY_MAX";
@@ -1337,8 +1853,8 @@ inline void bz_tree<Key, Val>::print_node(uint64_t ptr, int extra)
 }
 
 /* ӡṹ̵߳ */
-template<typename Key, typename Val>
-void bz_tree<Key, Val>::print_tree(bool pr)
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::print_tree(bool pr)
 {
 	if (!pr)
 		return;
@@ -1374,9 +1890,9 @@ set meta entry to visiable and correct offset
 7.2) if Frozen bit is set, abort and retry the insert
 */
 /* ִҶڵ */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::insert(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch)
+int bz_node<Key, Val, Cmp>::insert(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch)
 {
 	/* Global variables */
 	uint64_t * meta_arr = rec_meta_arr();
@@ -1436,7 +1952,9 @@ int bz_node<Key, Val>::insert(bz_tree<Key, TreeVal> * tree, const Key * key, con
 	print_log("IS-pos", key, rec_cnt);
 
 	/* copy key and val */
-	uint32_t new_offset = node_sz - blk_sz - total_size - 1;
+	uint32_t new_offset = node_sz - blk_sz - total_size;
+	set_fingerprint(rec_cnt, key);
+	persist_fingerprints(rec_cnt, 1);
 	copy_data(new_offset, key, val, key_size, total_size);
 
 	if (recheck) {
@@ -1494,9 +2012,9 @@ node status: delete size += data length
 1.2) otherwise, read and retry
 */
 /* Ҷڵɾ */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::remove(bz_tree<Key, TreeVal> * tree, const Key * key)
+int bz_node<Key, Val, Cmp>::remove(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const uint64_t * version)
 {
 	/* Global variables */
 	uint64_t * meta_arr = rec_meta_arr();
@@ -1512,6 +2030,8 @@ int bz_node<Key, Val>::remove(bz_tree<Key, TreeVal> * tree, const Key * key)
 	bool useless;
 	if (!find_key_sorted(key, pos) && !find_key_unsorted(key, status_rd, 0, pos, useless))
 		return ENOTFOUND;
+	if (version && record_version(pos) != *version)
+		return EMISMATCH;
 
 	print_log("RM-pos", key, pos);
 
@@ -1520,7 +2040,7 @@ int bz_node<Key, Val>::remove(bz_tree<Key, TreeVal> * tree, const Key * key)
 		uint64_t meta_rd = pmwcas_read(&meta_arr[pos]);
 		if (!is_visiable(meta_rd)) {
 			/* ̵߳ľɾ */
-			return ENOTFOUND;
+			return version ? EMISMATCH : ENOTFOUND;
 		}
 
 		status_rd = pmwcas_read(&status_);
@@ -1581,9 +2101,9 @@ in case fail:
 otherwise, read origin meta and status, retry pmwcas
 */
 /* Ҷڵݸ */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::update(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch)
+int bz_node<Key, Val, Cmp>::update(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch, const uint64_t * version)
 {
 	/* Global variables */
 	uint64_t * meta_arr = rec_meta_arr();
@@ -1603,9 +2123,18 @@ int bz_node<Key, Val>::update(bz_tree<Key, TreeVal> * tree, const Key * key, con
 	if (!find_key_sorted(key, del_pos)
 		&& !find_key_unsorted(key, status_rd, alloc_epoch, del_pos, recheck))
 		return ENOTFOUND;
+	/* a versioned update always writes a new record, so that it gets a new version */
+	if (version && record_version(del_pos) != *version)
+		return EMISMATCH;
 
 	print_log("UP-find", key, del_pos);
 
+#ifdef BZ_INPLACE_VALUE
+	int inplace_ret = version ? ENONEED : update_inplace(tree, del_pos, status_rd, val, key_size, total_size);
+	if (inplace_ret != ENONEED)
+		return inplace_ret;
+#endif // BZ_INPLACE_VALUE
+
 	while (true)
 	{
 		rec_cnt = get_record_count(status_rd);
@@ -1644,7 +2173,9 @@ int bz_node<Key, Val>::update(bz_tree<Key, TreeVal> * tree, const Key * key, con
 	print_log("UP-pos", key, rec_cnt);
 
 	/* copy key and val */
-	uint32_t new_offset = node_sz - blk_sz - total_size - 1;
+	uint32_t new_offset = node_sz - blk_sz - total_size;
+	set_fingerprint(rec_cnt, key);
+	persist_fingerprints(rec_cnt, 1);
 	copy_data(new_offset, key, val, key_size, total_size);
 
 	if (recheck) {
@@ -1677,7 +2208,7 @@ int bz_node<Key, Val>::update(bz_tree<Key, TreeVal> * tree, const Key * key, con
 			persist(&meta_arr[rec_cnt], sizeof(uint64_t));
 			if (!add_dele_sz(tree, total_size))
 				return EFROZEN;
-			return ERACE;
+			return version ? EMISMATCH : ERACE;
 		}
 		uint64_t status_new = status_del(status_rd, get_total_length(meta_del));
 		uint64_t meta_del_new = meta_vis_off(meta_del, false, 0);
@@ -1706,45 +2237,144 @@ int bz_node<Key, Val>::update(bz_tree<Key, TreeVal> * tree, const Key * key, con
 }
 
 /*
-read
-1) binary search on sorted keys
-2) linear scan on unsorted keys
-3) return the record found
+* overwrite the 8-byte value of the record at @param pos:
+* 2-word PMwCAS of the value word and the unchanged status,
+* any concurrent change of the node (delete, append, freeze) fails it.
+* Takes no block space and leaves no deleted record behind
+* @return ENONEED if the record or the new value does not qualify
 */
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::read(bz_tree<Key, TreeVal> * tree, const Key * key, Val * val, uint32_t max_val_size)
+int bz_node<Key, Val, Cmp>::update_inplace(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t pos, uint64_t status_rd, const Val * val, uint32_t key_size, uint32_t total_size)
 {
-	/* Global variables */
-	uint32_t pos;
-
-	/* Ŀֵ */
-	uint64_t status_rd = pmwcas_read(&status_);
-	bool useless;
-	if (!find_key_sorted(key, pos) && !find_key_unsorted(key, status_rd, 0, pos, useless))
-		return ENOTFOUND;
-
-	uint64_t * meta_arr = rec_meta_arr();
-	uint64_t meta_rd = pmwcas_read(&meta_arr[pos]);
-	if (get_total_length(meta_rd) - get_key_length(meta_rd) > max_val_size)
-		return ENOSPACE;
-
-	copy_value(val, get_value(meta_rd));
-	return 0;
+	if (total_size - key_size != sizeof(uint64_t))
+		return ENONEED;
+	uint64_t val_new;
+	memcpy(&val_new, val, sizeof(uint64_t));
+	/* the PMwCAS control bits must stay clear */
+	if (val_new & (MwCAS_BIT | RDCSS_BIT | DIRTY_BIT))
+		return ENONEED;
+	int ret = write_inplace(tree, pos, status_rd, BZ_ACTION_UPDATE, val_new, nullptr);
+	return ret == EVALUE ? ENONEED : ret;
 }
 
-/* keyִupdateִinsert */
-/* Upsert */
-template<typename Key, typename Val>
+/*
+* the PMwCAS loop of the in-place writes, on the value word of the record at @param pos:
+* BZ_ACTION_UPDATE stores @param arg, BZ_ACTION_FETCH_ADD adds it,
+* BZ_ACTION_CAS stores it if the value still equals *@param io.
+* @param io (optional) receives the value replaced, or the one that did not match
+* @return EVALUE if the record is not an 8-byte value word or the result
+*		would set a PMwCAS control bit, EMISMATCH, ERACE if the record is gone
+*/
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-int bz_node<Key, Val>::upsert(bz_tree<Key, TreeVal> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch)
+int bz_node<Key, Val, Cmp>::write_inplace(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t pos, uint64_t status_rd, int action, uint64_t arg, uint64_t * io)
 {
-	/* Global variables */
 	uint64_t * meta_arr = rec_meta_arr();
-	uint32_t node_sz = get_node_size(length_);
-	uint32_t sorted_cnt = get_sorted_count(length_);
-	bool recheck = false, found = false;
-	uint64_t meta_new;
+	while (true)
+	{
+		uint64_t meta_rd = pmwcas_read(&meta_arr[pos]);
+		if (!is_visiable(meta_rd))
+			return ERACE;
+		uint64_t * word = value_word(meta_rd);
+		if (!word)
+			return EVALUE;
+		uint64_t val_rd = pmwcas_read(word);
+		uint64_t val_new = arg;
+		if (action == BZ_ACTION_FETCH_ADD)
+			val_new = val_rd + arg;
+		else if (action == BZ_ACTION_CAS && val_rd != *io) {
+			*io = val_rd;
+			return EMISMATCH;
+		}
+		if (val_new & (MwCAS_BIT | RDCSS_BIT | DIRTY_BIT))
+			return EVALUE;
+		int cas_res = tree->pack_pmwcas({
+			{ &status_, status_rd, status_rd },
+			{ word, val_rd, val_new }
+			});
+		if (!cas_res) {
+			if (io)
+				*io = val_rd;
+			break;
+		}
+		if (EPMWCASALLOC == cas_res)
+			return EPMWCASALLOC;
+		status_rd = pmwcas_read(&status_);
+		if (is_frozen(status_rd))
+			return EFROZEN;
+	}
+	print_log("UP-inplace", nullptr, pos);
+	return 0;
+}
+
+/* fetch_add / compare_and_swap of the value of @param key, see write_inplace */
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::rmw(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, int action, const Val * arg, Val * io)
+{
+	if (sizeof(Val) != sizeof(uint64_t))
+		return EVALUE;
+	uint64_t arg_rd;
+	memcpy(&arg_rd, arg, sizeof(uint64_t));
+	while (true)
+	{
+		uint64_t status_rd = pmwcas_read(&status_);
+		if (is_frozen(status_rd))
+			return EFROZEN;
+		uint32_t pos;
+		bool useless;
+		if (!find_key_sorted(key, pos) && !find_key_unsorted(key, status_rd, 0, pos, useless))
+			return ENOTFOUND;
+		/* a record replaced meanwhile: look the key up again */
+		int ret = write_inplace(tree, pos, status_rd, action, arg_rd, (uint64_t*)io);
+		if (ret != ERACE)
+			return ret;
+	}
+}
+
+/*
+read
+1) binary search on sorted keys
+2) linear scan on unsorted keys
+3) return the record found
+*/
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::read(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, Val * val, uint32_t max_val_size, uint64_t * version)
+{
+	/* Global variables */
+	uint32_t pos;
+
+	/* Ŀֵ */
+	uint64_t status_rd = pmwcas_read(&status_);
+	bool useless;
+	if (!find_key_sorted(key, pos) && !find_key_unsorted(key, status_rd, 0, pos, useless))
+		return ENOTFOUND;
+
+	uint64_t * meta_arr = rec_meta_arr();
+	uint64_t meta_rd = pmwcas_read(&meta_arr[pos]);
+	if (get_total_length(meta_rd) - get_key_length(meta_rd) > max_val_size)
+		return ENOSPACE;
+
+	read_value(val, meta_rd);
+	if (version)
+		*version = record_version(pos);
+	return 0;
+}
+
+/* keyִupdateִinsert */
+/* Upsert */
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::upsert(bz_tree<Key, TreeVal, Cmp> * tree, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint32_t alloc_epoch)
+{
+	/* Global variables */
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t node_sz = get_node_size(length_);
+	uint32_t sorted_cnt = get_sorted_count(length_);
+	bool recheck = false, found = false;
+	uint64_t meta_new;
 	uint32_t rec_cnt, blk_sz;
 
 	/* not Frozen */
@@ -1760,6 +2390,14 @@ int bz_node<Key, Val>::upsert(bz_tree<Key, TreeVal> * tree, const Key * key, con
 
 	print_log("US-find", key, del_pos);
 
+#ifdef BZ_INPLACE_VALUE
+	if (found) {
+		int inplace_ret = update_inplace(tree, del_pos, status_rd, val, key_size, total_size);
+		if (inplace_ret != ENONEED)
+			return inplace_ret;
+	}
+#endif // BZ_INPLACE_VALUE
+
 	while (true)
 	{
 		rec_cnt = get_record_count(status_rd);
@@ -1798,7 +2436,9 @@ int bz_node<Key, Val>::upsert(bz_tree<Key, TreeVal> * tree, const Key * key, con
 	print_log("US-pos", key, rec_cnt);
 
 	/* copy key and val */
-	uint32_t new_offset = node_sz - blk_sz - total_size - 1;
+	uint32_t new_offset = node_sz - blk_sz - total_size;
+	set_fingerprint(rec_cnt, key);
+	persist_fingerprints(rec_cnt, 1);
 	copy_data(new_offset, key, val, key_size, total_size);
 
 	if (recheck) {
@@ -1890,65 +2530,676 @@ int bz_node<Key, Val>::upsert(bz_tree<Key, TreeVal> * tree, const Key * key, con
 }
 
 /*
-range scan: [beg_key, end_key)
-one leaf node at a time
-1) enter the epoch
-2) construct a response_array(visiable and not deleted)
-3) exit epoch
-4) one-record-at-a-time
-5) enter new epoch
-6) greater than search the largest key in response array
+* batched insert / upsert of sorted records that all belong to this leaf:
+* one PMwCAS reserves the space and the meta entries of the whole group,
+* the payloads are copied and flushed at once, one PMwCAS publishes them.
+* A group is bounded by the PMwCAS word limit (status + new metas + replaced metas).
+* @param done: number of @param ops handled, their ret is set
+* @return 0, or a node level error (EFROZEN, EALLOCSIZE, EPMWCASALLOC):
+*		nothing was written then and the ops must be retried
 */
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::write_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, bool upsert, uint32_t alloc_epoch, uint32_t & done)
+{
+	/* Global variables */
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t node_sz = get_node_size(length_);
+	uint32_t sorted_cnt = get_sorted_count(length_);
+	bool recheck = false;
+	uint32_t rec_cnt, blk_sz;
+	/* the group: op index, replaced record (-1 if none), payload offset, result */
+	uint32_t grp[WORD_DESCRIPTOR_SIZE];
+	int del_pos[WORD_DESCRIPTOR_SIZE];
+	uint32_t new_offset[WORD_DESCRIPTOR_SIZE];
+	int grp_ret[WORD_DESCRIPTOR_SIZE];
+	uint32_t grp_cnt = 0, grp_sz = 0, words = 1;
 
-template<typename Key, typename Val>
-std::vector<std::pair<std::shared_ptr<Key>, std::shared_ptr<Val>>>
-bz_node<Key, Val>::range_scan(const Key * beg_key, const Key * end_key)
+	uint64_t status_rd = pmwcas_read(&status_);
+	if (is_frozen(status_rd))
+		return EFROZEN;
+
+	/* pick the group */
+	for (done = 0; done < n; ++done) {
+		bz_write_op<Key, Val> * op = ops[done];
+		/* the same key twice: the second one goes to the next batch */
+		if (done && !bz_key_compare<Key, Cmp>()(ops[done - 1]->key, op->key))
+			break;
+		uint32_t pos;
+		bool found = find_key_sorted(op->key, pos)
+			|| find_key_unsorted(op->key, status_rd, alloc_epoch, pos, recheck);
+		if (found && !upsert) {
+			op->ret = EUNIKEY;
+			continue;
+		}
+		uint32_t need = words + 1 + (found ? 1 : 0);
+		if (need > WORD_DESCRIPTOR_SIZE
+			|| get_block_size(status_rd) + grp_sz + op->total_size
+			+ sizeof(uint64_t) * (get_record_count(status_rd) + grp_cnt + 1) + sizeof(*this) > node_sz)
+			break;
+		words = need;
+		grp[grp_cnt] = done;
+		del_pos[grp_cnt] = found ? (int)pos : -1;
+		grp_ret[grp_cnt] = 0;
+		grp_sz += op->total_size;
+		++grp_cnt;
+	}
+	if (!grp_cnt)
+		return done ? 0 : EALLOCSIZE;
+
+	/* reserve: record count, block size and the meta entries of the group */
+	uint64_t meta_new = meta_vis_off(0, false, alloc_epoch);
+	std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn;
+	while (true)
+	{
+		rec_cnt = get_record_count(status_rd);
+		blk_sz = get_block_size(status_rd);
+		if (blk_sz + grp_sz + sizeof(uint64_t) * (rec_cnt + grp_cnt) + sizeof(*this) > node_sz)
+			return EALLOCSIZE;
+
+		uint64_t status_new = status_rd;
+		set_record_count(status_new, rec_cnt + grp_cnt);
+		set_block_size(status_new, blk_sz + grp_sz);
+		casn.clear();
+		casn.emplace_back(&status_, status_rd, status_new);
+		for (uint32_t j = 0; j < grp_cnt; ++j)
+			casn.emplace_back(&meta_arr[rec_cnt + j], pmwcas_read(&meta_arr[rec_cnt + j]), meta_new);
+
+		int cas_res = tree->pack_pmwcas(casn);
+		if (!cas_res)
+			break;
+		if (EPMWCASALLOC == cas_res)
+			return EPMWCASALLOC;
+
+		recheck = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		status_rd = pmwcas_read(&status_);
+		if (is_frozen(status_rd))
+			return EFROZEN;
+	}
+
+	/* copy all the payloads, one flush */
+	uint32_t end_offset = node_sz - blk_sz, offset = end_offset;
+	for (uint32_t j = 0; j < grp_cnt; ++j) {
+		bz_write_op<Key, Val> * op = ops[grp[j]];
+		offset -= op->total_size;
+		new_offset[j] = offset;
+		set_key(offset, op->key, op->key_size);
+		set_value(offset + op->key_size, op->val, op->total_size - op->key_size);
+		set_fingerprint(rec_cnt + j, op->key);
+	}
+	persist((char *)this + offset, end_offset - offset);
+	persist_fingerprints(rec_cnt, grp_cnt);
+
+	/* a record may have been inserted concurrently: drop ours, its space is deleted */
+	uint32_t dead_sz = 0;
+	if (recheck) {
+		for (uint32_t j = 0; j < grp_cnt; ++j) {
+			uint32_t beg_pos = del_pos[j] >= 0 ? del_pos[j] + 1 : sorted_cnt;
+			if (find_dup_unsorted(beg_pos, rec_cnt, ops[grp[j]]->key, alloc_epoch))
+				dead_sz += drop_batch_slot(rec_cnt, grp_ret, j, EUNIKEY, ops[grp[j]]->total_size);
+		}
+	}
+
+	/* publish: status + new metas (+ the replaced metas of an upsert) */
+	while (true)
+	{
+		status_rd = pmwcas_read(&status_);
+		if (is_frozen(status_rd)) {
+			for (uint32_t j = 0; j < grp_cnt; ++j)
+				if (!grp_ret[j])
+					drop_batch_slot(rec_cnt, grp_ret, j, EFROZEN, 0);
+			return EFROZEN;
+		}
+
+		bool race = false;
+		uint64_t status_new = status_rd;
+		casn.clear();
+		casn.emplace_back(&status_, status_rd, status_rd);
+		for (uint32_t j = 0; j < grp_cnt && !race; ++j) {
+			if (grp_ret[j])
+				continue;
+			bz_write_op<Key, Val> * op = ops[grp[j]];
+			if (del_pos[j] >= 0) {
+				uint64_t meta_del = pmwcas_read(&meta_arr[del_pos[j]]);
+				if (!is_visiable(meta_del)) {
+					/* removed in the meantime, like upsert() */
+					dead_sz += drop_batch_slot(rec_cnt, grp_ret, j, ERACE, op->total_size);
+					race = true;
+					break;
+				}
+				status_new = status_del(status_new, get_total_length(meta_del));
+				casn.emplace_back(&meta_arr[del_pos[j]], meta_del, meta_vis_off(meta_del, false, 0));
+			}
+			casn.emplace_back(&meta_arr[rec_cnt + j], meta_new,
+				meta_vis_off_klen_tlen(0, true, new_offset[j], op->key_size, op->total_size));
+		}
+		if (race)
+			continue;
+		std::get<2>(casn[0]) = status_del(status_new, dead_sz);
+
+		int cas_res = tree->pack_pmwcas(casn);
+		if (!cas_res)
+			break;
+		if (EPMWCASALLOC == cas_res) {
+			for (uint32_t j = 0; j < grp_cnt; ++j)
+				if (!grp_ret[j])
+					dead_sz += drop_batch_slot(rec_cnt, grp_ret, j, EPMWCASALLOC, ops[grp[j]]->total_size);
+			if (!add_dele_sz(tree, dead_sz))
+				return EFROZEN;
+			return EPMWCASALLOC;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	for (uint32_t j = 0; j < grp_cnt; ++j)
+		ops[grp[j]]->ret = grp_ret[j];
+	return 0;
+}
+/* give up the reserved meta entry @param j of a batch, @return its size to delete */
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_node<Key, Val, Cmp>::drop_batch_slot(uint32_t rec_cnt, int * grp_ret, uint32_t j, int ret, uint32_t total_size)
 {
-	std::vector<std::pair<std::shared_ptr<Key>, std::shared_ptr<Val>>> res;
 	uint64_t * meta_arr = rec_meta_arr();
+	grp_ret[j] = ret;
+	set_offset(meta_arr[rec_cnt + j], 0);
+	persist(&meta_arr[rec_cnt + j], sizeof(uint64_t));
+	return total_size;
+}
+
+/*
+* first half of an atomic batch: reserve and fill the records of all the
+* @param n ops, they stay invisible until publish_batch_words() goes through.
+* @param del_pos receives the record each op replaces (-1 if none),
+* @param new_offset its payload, @param rec_cnt the first reserved meta entry.
+* The batch waits here for the same-epoch inserts before its own records
+* only, so batches reserving their leaves in key order never wait in a cycle.
+* @return EUNIKEY, ERACE (upsert lost a race, retry), EFROZEN, EALLOCSIZE, EPMWCASALLOC
+*/
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::reserve_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, bool upsert, uint32_t alloc_epoch, int * del_pos, uint32_t * new_offset, uint32_t & rec_cnt)
+{
+	/* Global variables */
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t node_sz = get_node_size(length_);
 	uint32_t sorted_cnt = get_sorted_count(length_);
+	bool recheck = false;
+	uint32_t blk_sz, grp_sz = 0;
 
-	uint32_t bin_beg_pos = binary_search(beg_key, sorted_cnt);
-	uint32_t bin_end_pos = end_key ? binary_search(end_key, sorted_cnt) : sorted_cnt;
-	for (uint32_t i = bin_beg_pos; i < bin_end_pos; ++i) {
-		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
-		if (is_visiable(meta_rd) && key_cmp(meta_rd, beg_key) >= 0
-			&& (!end_key || key_cmp(meta_rd, end_key) < 0))
-			copy_data(meta_rd, res);
+	uint64_t status_rd = pmwcas_read(&status_);
+	if (is_frozen(status_rd))
+		return EFROZEN;
+	for (uint32_t j = 0; j < n; ++j) {
+		uint32_t pos;
+		bool found = find_key_sorted(ops[j]->key, pos)
+			|| find_key_unsorted(ops[j]->key, status_rd, alloc_epoch, pos, recheck);
+		if (found && !upsert)
+			return EUNIKEY;
+		del_pos[j] = found ? (int)pos : -1;
+		grp_sz += ops[j]->total_size;
+	}
+
+	uint64_t meta_new = meta_vis_off(0, false, alloc_epoch);
+	std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn;
+	while (true)
+	{
+		rec_cnt = get_record_count(status_rd);
+		blk_sz = get_block_size(status_rd);
+		if (blk_sz + grp_sz + sizeof(uint64_t) * (rec_cnt + n) + sizeof(*this) > node_sz)
+			return EALLOCSIZE;
+
+		uint64_t status_new = status_rd;
+		set_record_count(status_new, rec_cnt + n);
+		set_block_size(status_new, blk_sz + grp_sz);
+		casn.clear();
+		casn.emplace_back(&status_, status_rd, status_new);
+		for (uint32_t j = 0; j < n; ++j)
+			casn.emplace_back(&meta_arr[rec_cnt + j], pmwcas_read(&meta_arr[rec_cnt + j]), meta_new);
+
+		int cas_res = tree->pack_pmwcas(casn);
+		if (!cas_res)
+			break;
+		if (EPMWCASALLOC == cas_res)
+			return EPMWCASALLOC;
+
+		recheck = true;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		status_rd = pmwcas_read(&status_);
+		if (is_frozen(status_rd))
+			return EFROZEN;
+	}
+
+	uint32_t end_offset = node_sz - blk_sz, offset = end_offset;
+	for (uint32_t j = 0; j < n; ++j) {
+		offset -= ops[j]->total_size;
+		new_offset[j] = offset;
+		set_key(offset, ops[j]->key, ops[j]->key_size);
+		set_value(offset + ops[j]->key_size, ops[j]->val, ops[j]->total_size - ops[j]->key_size);
+		set_fingerprint(rec_cnt + j, ops[j]->key);
 	}
+	persist((char *)this + offset, end_offset - offset);
+	persist_fingerprints(rec_cnt, n);
 
+	if (recheck) {
+		for (uint32_t j = 0; j < n; ++j) {
+			uint32_t beg_pos = del_pos[j] >= 0 ? del_pos[j] + 1 : sorted_cnt;
+			if (find_dup_unsorted(beg_pos, rec_cnt, ops[j]->key, alloc_epoch)) {
+				drop_batch(tree, ops, n, rec_cnt);
+				return upsert ? ERACE : EUNIKEY;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+* second half of an atomic batch: append this leaf's words to @param casn,
+* the status (delete size grown by the replaced records), the replaced metas
+* and the reserved ones, made visible
+* @return EFROZEN, ERACE if a replaced record is gone
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_node<Key, Val, Cmp>::publish_batch_words(bz_write_op<Key, Val> ** ops, uint32_t n, uint32_t alloc_epoch, const int * del_pos, const uint32_t * new_offset, uint32_t rec_cnt,
+	std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> & casn)
+{
+	uint64_t * meta_arr = rec_meta_arr();
 	uint64_t status_rd = pmwcas_read(&status_);
-	uint32_t rec_cnt = get_record_count(status_rd);
-	for (uint32_t i = sorted_cnt; i < rec_cnt; ++i) {
-		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
-		if (is_visiable(meta_rd) && key_cmp(meta_rd, beg_key) >= 0
-			&& (!end_key || key_cmp(meta_rd, end_key) < 0)) {
-			copy_data(meta_rd, res);
+	if (is_frozen(status_rd))
+		return EFROZEN;
+
+	uint64_t status_new = status_rd;
+	size_t status_pos = casn.size();
+	casn.emplace_back(&status_, status_rd, status_rd);
+	uint64_t meta_new = meta_vis_off(0, false, alloc_epoch);
+	for (uint32_t j = 0; j < n; ++j) {
+		if (del_pos[j] >= 0) {
+			uint64_t meta_del = pmwcas_read(&meta_arr[del_pos[j]]);
+			if (!is_visiable(meta_del))
+				return ERACE;
+			status_new = status_del(status_new, get_total_length(meta_del));
+			casn.emplace_back(&meta_arr[del_pos[j]], meta_del, meta_vis_off(meta_del, false, 0));
 		}
+		casn.emplace_back(&meta_arr[rec_cnt + j], meta_new,
+			meta_vis_off_klen_tlen(0, true, new_offset[j], ops[j]->key_size, ops[j]->total_size));
+	}
+	std::get<2>(casn[status_pos]) = status_new;
+	return 0;
+}
+
+/* give up the @param n records reserved by reserve_batch(), their space is deleted */
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+void bz_node<Key, Val, Cmp>::drop_batch(bz_tree<Key, TreeVal, Cmp> * tree, bz_write_op<Key, Val> ** ops, uint32_t n, uint32_t rec_cnt)
+{
+	uint64_t * meta_arr = rec_meta_arr();
+	uint32_t dead_sz = 0;
+	for (uint32_t j = 0; j < n; ++j) {
+		set_offset(meta_arr[rec_cnt + j], 0);
+		dead_sz += ops[j]->total_size;
+	}
+	persist(&meta_arr[rec_cnt], sizeof(uint64_t) * n);
+	/* a frozen leaf is left as is, its SMO skips the invisible records */
+	add_dele_sz(tree, dead_sz);
+}
+
+template<typename Key, typename Val, typename Cmp>
+bz_cursor<Key, Val, Cmp>::bz_cursor(bz_tree<Key, Val, Cmp> * tree, bool follow_siblings, bool reverse)
+	: tree_(tree), pos_(0), from_(nullptr), from_incl_(true), steps_(0), end_(nullptr), siblings_(follow_siblings), reverse_(reverse)
+{
+	tree_->register_this();
+	tree_->acquire_rd();
+}
+
+template<typename Key, typename Val, typename Cmp>
+bz_cursor<Key, Val, Cmp>::~bz_cursor()
+{
+	tree_->release();
+}
+
+/*
+* forward: position on the first key >= @param beg_key, stop before @param end_key
+* reverse: position on the last key <= @param beg_key, stop after @param end_key
+* (@param end_key is optional)
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_cursor<Key, Val, Cmp>::seek(const Key * beg_key, const Key * end_key)
+{
+	copy_bound(beg_buf_, beg_key);
+	from_ = (const Key*)beg_buf_.data();
+	from_incl_ = true;
+	end_ = nullptr;
+	if (end_key) {
+		copy_bound(end_buf_, end_key);
+		end_ = (const Key*)end_buf_.data();
 	}
+	descend(from_);
+	load_leaf();
+	if (!valid())
+		next();
+}
 
-	return res;
+template<typename Key, typename Val, typename Cmp>
+void bz_cursor<Key, Val, Cmp>::next()
+{
+	++steps_;
+	if (pos_ < metas_.size() && ++pos_ == metas_.size()) {
+		from_ = leaf_->full_key(metas_[pos_ - 1], from_buf_);
+		from_incl_ = false;
+	}
+	while (pos_ == metas_.size()) {
+		if (!next_leaf())
+			return;
+		load_leaf();
+	}
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_cursor<Key, Val, Cmp>::valid()
+{
+	return pos_ < metas_.size();
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline const Key * bz_cursor<Key, Val, Cmp>::key()
+{
+	return leaf_->full_key(metas_[pos_], key_bufs_[steps_ & 1]);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline const Val * bz_cursor<Key, Val, Cmp>::value()
+{
+	return leaf_->get_value(metas_[pos_]);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_cursor<Key, Val, Cmp>::key_size()
+{
+	return leaf_->full_key_length(metas_[pos_]);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_cursor<Key, Val, Cmp>::value_size()
+{
+	return get_total_length(metas_[pos_]) - get_key_length(metas_[pos_]);
+}
+
+/*
+* copy records into a caller supplied arena as bz_scan_rec entries,
+* advancing the cursor past them; stops when the next one does not fit.
+* @return number of records copied, @param used: bytes written.
+* 0 with a valid cursor: the next record alone needs more than @param buf_size,
+* @param used then tells how many bytes, the cursor stays on it
+*/
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_cursor<Key, Val, Cmp>::fill(char * buf, uint32_t buf_size, uint32_t & used)
+{
+	uint32_t cnt = 0;
+	used = 0;
+	for (; valid(); next(), ++cnt) {
+		uint64_t meta_rd = metas_[pos_];
+		uint32_t key_sz = key_size();
+		uint32_t tot_sz = key_sz + value_size();
+		uint32_t rec_sz = sizeof(bz_scan_rec) + ((tot_sz + 7) & ~7u);
+		if (used + rec_sz > buf_size) {
+			if (!cnt)
+				used = rec_sz;
+			break;
+		}
+		bz_scan_rec * rec = (bz_scan_rec*)(buf + used);
+		rec->key_size = key_sz;
+		rec->total_size = tot_sz;
+		memcpy(rec + 1, key(), key_sz);
+		memcpy((char*)(rec + 1) + key_sz, leaf_->get_value(meta_rd), tot_sz - key_sz);
+		if (leaf_->value_word(meta_rd))
+			leaf_->read_value((Val*)rec->value(), meta_rd);
+		used += rec_sz;
+	}
+	return cnt;
+}
+
+/* copy the current record out, @return ENOTFOUND past the end, ENOSPACE if a buffer is too small */
+template<typename Key, typename Val, typename Cmp>
+int bz_cursor<Key, Val, Cmp>::copy_record(Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size)
+{
+	if (!valid())
+		return ENOTFOUND;
+	uint64_t meta_rd = metas_[pos_];
+	if (key_size() > max_key_size || value_size() > max_val_size)
+		return ENOSPACE;
+	memcpy(key_buf, key(), key_size());
+	leaf_->read_value(val_buf, meta_rd);
+	return 0;
+}
+
+/* keep a private copy of a caller's key, padded for the BZ_KEY_MAX check */
+template<typename Key, typename Val, typename Cmp>
+void bz_cursor<Key, Val, Cmp>::copy_bound(std::string & buf, const Key * key)
+{
+	uint32_t key_sz = bz_codec<Key>::size(key);
+	buf.assign((const char*)key, key_sz);
+	if (buf.size() < sizeof(uint64_t))
+		buf.resize(sizeof(uint64_t), 0);
+}
+
+/* @param meta_rd (visible) is not yet returned by the scan */
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_cursor<Key, Val, Cmp>::after_from(uint64_t meta_rd)
+{
+	int cmp = leaf_->key_cmp(meta_rd, from_);
+	if (reverse_)
+		cmp = -cmp;
+	return cmp > 0 || (!cmp && from_incl_);
+}
+
+/* @param meta_rd (visible) is before the end of the scan */
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_cursor<Key, Val, Cmp>::before_end(uint64_t meta_rd)
+{
+	if (!end_)
+		return true;
+	int cmp = leaf_->key_cmp(meta_rd, end_);
+	return reverse_ ? cmp > 0 : cmp < 0;
+}
+
+/* walk from the root to the leaf covering @param key (or the keys right after it), remembering the path */
+template<typename Key, typename Val, typename Cmp>
+void bz_cursor<Key, Val, Cmp>::descend(const Key * key)
+{
+	path_.reset();
+	leaf_.set_null();
+	uint64_t ptr = pmwcas_read(&tree_->root_);
+	if (!ptr)
+		return;
+	path_.push(ptr, -1);
+	while (!is_leaf_node(ptr)) {
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+		int child_id = (int)node->binary_search(key);
+		/* an exclusive bound equal to a separator belongs to the next child */
+		if (!reverse_ && !from_incl_ && (uint32_t)child_id + 1 < get_record_count(pmwcas_read(&node->status_))
+			&& !bz_key_compare<Key, Cmp>()(node->nth_key(child_id), key))
+			++child_id;
+		ptr = pmwcas_read(node->nth_val(child_id));
+		path_.push(ptr, child_id);
+	}
+	leaf_ = rel_ptr<bz_node<Key, Val, Cmp>>(ptr);
+}
+
+/* separator right below the current leaf, nullptr for the leftmost leaf */
+template<typename Key, typename Val, typename Cmp>
+const Key * bz_cursor<Key, Val, Cmp>::lower_fence()
+{
+	for (int i = path_.count - 1; i > 0; --i) {
+		if (path_.child_ids[i] > 0) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_.nodes[i - 1]);
+			return parent->nth_key(path_.child_ids[i] - 1);
+		}
+	}
+	return nullptr;
+}
+
+/*
+* move to the next leaf in scan order:
+* everything between the current leaf's fence and from_ has been returned,
+* so the fence becomes the bound of what is left.
+* forward: the upper fence (inclusive in the leaf) is excluded from now on,
+* reverse: the lower fence (the left leaf's upper one) is included
+*/
+template<typename Key, typename Val, typename Cmp>
+bool bz_cursor<Key, Val, Cmp>::next_leaf()
+{
+	if (leaf_.is_null())
+		return false;
+	const Key * fence = nullptr;
+	if (path_.count >= 2) {
+		if (reverse_) {
+			fence = lower_fence();
+		}
+		else {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_.nodes[path_.count - 2]);
+			fence = parent->nth_key(path_.get_child_id());
+			if (bz_codec<Key>::is_max(fence))
+				fence = nullptr;
+		}
+	}
+	if (fence && end_) {
+		int cmp = bz_key_compare<Key, Cmp>()(fence, end_);
+		if (reverse_ ? cmp <= 0 : cmp >= 0)
+			fence = nullptr;
+	}
+	if (!fence) {
+		leaf_.set_null();
+		return false;
+	}
+	from_ = fence;
+	from_incl_ = reverse_;
+	if (siblings_ && (reverse_ ? step_left() : step_right()) && !is_frozen(pmwcas_read(&leaf_->status_)))
+		return true;
+	/* the path went stale or the sibling is being replaced: re-seek from the root */
+	descend(from_);
+	return !leaf_.is_null();
+}
+
+/* follow the parent path to the leftmost leaf of the next subtree */
+template<typename Key, typename Val, typename Cmp>
+bool bz_cursor<Key, Val, Cmp>::step_right()
+{
+	while (path_.count > 1) {
+		int child_id = path_.get_child_id();
+		path_.pop();
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_.get_node());
+		uint32_t child_cnt = get_record_count(pmwcas_read(&parent->status_));
+		if ((uint32_t)child_id + 1 >= child_cnt)
+			continue;
+		uint64_t ptr = pmwcas_read(parent->nth_val(child_id + 1));
+		path_.push(ptr, child_id + 1);
+		while (!is_leaf_node(ptr)) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+			ptr = pmwcas_read(node->nth_val(0));
+			path_.push(ptr, 0);
+		}
+		leaf_ = rel_ptr<bz_node<Key, Val, Cmp>>(ptr);
+		return true;
+	}
+	return false;
+}
+
+/* follow the parent path to the rightmost leaf of the previous subtree */
+template<typename Key, typename Val, typename Cmp>
+bool bz_cursor<Key, Val, Cmp>::step_left()
+{
+	while (path_.count > 1) {
+		int child_id = path_.get_child_id();
+		path_.pop();
+		if (child_id == 0)
+			continue;
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> parent(path_.get_node());
+		uint64_t ptr = pmwcas_read(parent->nth_val(child_id - 1));
+		path_.push(ptr, child_id - 1);
+		while (!is_leaf_node(ptr)) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+			int last = (int)get_record_count(pmwcas_read(&node->status_)) - 1;
+			ptr = pmwcas_read(node->nth_val(last));
+			path_.push(ptr, last);
+		}
+		leaf_ = rel_ptr<bz_node<Key, Val, Cmp>>(ptr);
+		return true;
+	}
+	return false;
+}
+
+/*
+* collect the records of the current leaf between from_ and end_ in scan order:
+* the sorted region is emitted as is (starting from a binary search),
+* only the small unsorted tail is sorted, then merged into it
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_cursor<Key, Val, Cmp>::load_leaf()
+{
+	metas_.clear();
+	tail_.clear();
+	pos_ = 0;
+	if (leaf_.is_null())
+		return;
+	uint64_t * meta_arr = leaf_->rec_meta_arr();
+	uint32_t sorted_cnt = get_sorted_count(leaf_->length_);
+	uint32_t rec_cnt = get_record_count(pmwcas_read(&leaf_->status_));
+	uint32_t pos = leaf_->binary_search(from_, sorted_cnt);
+	/* the sorted region is in order: compare with from_ only until it is passed */
+	bool passed = false;
+	int step = reverse_ ? -1 : 1;
+	int i = reverse_ ? (pos < sorted_cnt ? (int)pos : (int)sorted_cnt - 1) : (int)pos;
+	for (; i >= 0 && i < (int)sorted_cnt; i += step) {
+		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
+		if (!is_visiable(meta_rd))
+			continue;
+		if (!passed && !(passed = after_from(meta_rd)))
+			continue;
+		if (!before_end(meta_rd))
+			break;
+		metas_.push_back(meta_rd);
+	}
+	for (uint32_t i = sorted_cnt; i < rec_cnt; ++i) {
+		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
+		if (is_visiable(meta_rd) && after_from(meta_rd) && before_end(meta_rd))
+			tail_.push_back(meta_rd);
+	}
+	if (tail_.empty())
+		return;
+	uint32_t sorted_sz = (uint32_t)metas_.size();
+	metas_.resize(sorted_sz + tail_.size());
+	if (reverse_) {
+		auto greater = std::bind(&bz_node<Key, Val, Cmp>::key_cmp_meta, &*leaf_, std::placeholders::_2, std::placeholders::_1);
+		std::sort(tail_.begin(), tail_.end(), greater);
+		merge_meta_runs(metas_.data(), sorted_sz, tail_.data(), (uint32_t)tail_.size(), greater);
+	}
+	else {
+		auto less = std::bind(&bz_node<Key, Val, Cmp>::key_cmp_meta, &*leaf_, std::placeholders::_1, std::placeholders::_2);
+		std::sort(tail_.begin(), tail_.end(), less);
+		merge_meta_runs(metas_.data(), sorted_sz, tail_.data(), (uint32_t)tail_.size(), less);
+	}
 }
 
 /* ״ʹBzTree */
-template<typename Key, typename Val>
-void bz_tree<Key, Val>::first_use(PMEMobjpool * pop, PMEMoid base_oid)
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::first_use(PMEMobjpool * pop, PMEMoid base_oid)
 {
 	pmwcas_first_use(&pool_, pop, base_oid);
 	root_ = 0;
 	persist(&root_, sizeof(uint64_t));
 	epoch_ = 1;
 	persist(&epoch_, sizeof(uint32_t));
+	dram_ = nullptr;
 }
 
 /* ʼBzTree */
-template<typename Key, typename Val>
-int bz_tree<Key, Val>::init(PMEMobjpool * pop, PMEMoid base_oid)
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::init(PMEMobjpool * pop, PMEMoid base_oid, bool dram_inner)
 {
-	rel_ptr<bz_node<Key, Val>>::set_base(base_oid);
-	rel_ptr<rel_ptr<bz_node<Key, Val>>>::set_base(base_oid);
-	rel_ptr<bz_node<Key, uint64_t>>::set_base(base_oid);
-	rel_ptr<rel_ptr<bz_node<Key, uint64_t>>>::set_base(base_oid);
+	rel_ptr<bz_node<Key, Val, Cmp>>::set_base(base_oid);
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>>::set_base(base_oid);
+	rel_ptr<bz_node<Key, uint64_t, Cmp>>::set_base(base_oid);
+	rel_ptr<rel_ptr<bz_node<Key, uint64_t, Cmp>>>::set_base(base_oid);
 	rel_ptr<bz_node<uint64_t, uint64_t>>::set_base(base_oid);
 	rel_ptr<Key>::set_base(base_oid);
 	rel_ptr<Val>::set_base(base_oid);
@@ -1957,66 +3208,809 @@ int bz_tree<Key, Val>::init(PMEMobjpool * pop, PMEMoid base_oid)
 	if (ret)
 		return ret;
 	gc_register(pool_.gc);
+	/* the DRAM index is filled by recovery(), once in-flight PMwCAS are resolved */
+	dram_ = dram_inner ? new dram_index_t() : nullptr;
 	return 0;
 }
 /* ָBzTree */
-template<typename Key, typename Val>
-void bz_tree<Key, Val>::recovery()
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::recovery()
 {
 	pmwcas_recovery(&pool_);
 	++epoch_;
 	persist(&epoch_, sizeof(epoch_));
+	if (dram_)
+		rebuild_dram_index();
 }
 /* չ */
-template<typename Key, typename Val>
-void bz_tree<Key, Val>::finish()
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::finish()
 {
 	pmwcas_finish(&pool_);
+	delete dram_;
+	dram_ = nullptr;
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::insert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+{
+	return traverse(BZ_ACTION_INSERT, true, key, val, key_size, total_size);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::remove(const Key * key)
+{
+	return traverse(BZ_ACTION_DELETE, true, key);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::update(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+{
+	return traverse(BZ_ACTION_UPDATE, true, key, val, key_size, total_size);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::upsert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+{
+	return traverse(BZ_ACTION_UPSERT, true, key, val, key_size, total_size);
+}
+
+/* @param version (optional) receives the version of the record, see bz_node::record_version() */
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::read(const Key * key, Val * buffer, uint32_t max_val_size, uint64_t * version)
+{
+	return traverse(BZ_ACTION_READ, false, key, nullptr, 0, 0, buffer, max_val_size, version);
+}
+
+/*
+* update / remove only if the record still has the @param version read() gave:
+* checked by the PMwCAS that retires the record, EMISMATCH otherwise.
+* An SMO moving the record in between also fails them (spuriously),
+* a replaced record never passes.
+* In-place value writes (BZ_INPLACE_VALUE, 8-byte Val) keep the version,
+* so there both return EVALUE rather than miss a concurrent write
+*/
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::update_if_version(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size, uint64_t version)
+{
+#ifdef BZ_INPLACE_VALUE
+	if (sizeof(Val) == sizeof(uint64_t))
+		return EVALUE;
+#endif // BZ_INPLACE_VALUE
+	return traverse(BZ_ACTION_UPDATE, true, key, val, key_size, total_size, nullptr, 0, &version);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::remove_if_version(const Key * key, uint64_t version)
+{
+#ifdef BZ_INPLACE_VALUE
+	if (sizeof(Val) == sizeof(uint64_t))
+		return EVALUE;
+#endif // BZ_INPLACE_VALUE
+	return traverse(BZ_ACTION_DELETE, true, key, nullptr, 0, 0, nullptr, 0, &version);
+}
+
+/*
+* atomic read-modify-write of an 8-byte value, one PMwCAS on the leaf status
+* and the value word; needs BZ_INPLACE_VALUE, EVALUE otherwise.
+* add @param delta (wrapping) to the value, @param old_val receives the previous one
+*/
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::fetch_add(const Key * key, uint64_t delta, Val * old_val)
+{
+	return traverse(BZ_ACTION_FETCH_ADD, true, key, (const Val*)&delta, 0, 0, old_val);
+}
+
+/* store @param desired if the value equals @param expected, which receives the current value on EMISMATCH */
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::compare_and_swap(const Key * key, Val * expected, const Val * desired)
+{
+	return traverse(BZ_ACTION_CAS, true, key, desired, 0, 0, expected);
+}
+
+/*
+* look up @param n keys at once: the keys are sorted, and every subtree on
+* their paths is descended once, within a single epoch entry
+* @param buffers: one value buffer per key, @param rets: one read() result per key
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::multi_get(const Key * const * keys, uint32_t n, Val * const * buffers, uint32_t max_val_size, int * rets)
+{
+	register_this();
+	std::vector<uint32_t> order(n);
+	for (uint32_t i = 0; i < n; ++i)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [keys](uint32_t a, uint32_t b) {
+		return bz_key_compare<Key, Cmp>()(keys[a], keys[b]) < 0;
+	});
+
+	acquire_rd();
+	uint64_t root = pmwcas_read(&root_);
+	if (root)
+		multi_get_dfs(root, keys, order.data(), n, buffers, max_val_size, rets);
+	else
+		for (uint32_t i = 0; i < n; ++i)
+			rets[i] = ENOTFOUND;
+	release();
+	return 0;
+}
+
+/* serve the sorted keys @param order[0, n) from the subtree @param ptr */
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::multi_get_dfs(uint64_t ptr, const Key * const * keys, const uint32_t * order, uint32_t n, Val * const * buffers, uint32_t max_val_size, int * rets)
+{
+	if (is_leaf_node(ptr)) {
+		rel_ptr<bz_node<Key, Val, Cmp>> leaf(ptr);
+		for (uint32_t i = 0; i < n; ++i)
+			rets[order[i]] = leaf->read(this, keys[order[i]], buffers[order[i]], max_val_size);
+		return;
+	}
+	rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+	uint32_t beg = 0;
+	while (beg < n) {
+		/* keys up to the separator of the child share its subtree */
+		int child_id = (int)node->binary_search(keys[order[beg]]);
+		const Key * sep = node->nth_key(child_id);
+		uint32_t end = beg + 1;
+		while (end < n && bz_key_compare<Key, Cmp>()(keys[order[end]], sep) <= 0)
+			++end;
+		multi_get_dfs(pmwcas_read(node->nth_val(child_id)), keys, order + beg, end - beg, buffers, max_val_size, rets);
+		beg = end;
+	}
+}
+
+/*
+* ordered lookups around @param key, the record found is copied to
+* @param key_buf / @param val_buf; ENOTFOUND if there is none, ENOSPACE if it does not fit.
+* lower_bound: first key >= @param key, upper_bound: first key > @param key
+*/
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::lower_bound(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size)
+{
+	return neighbour(key, false, true, key_buf, max_key_size, val_buf, max_val_size);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::upper_bound(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size)
+{
+	return neighbour(key, false, false, key_buf, max_key_size, val_buf, max_val_size);
+}
+
+/* last key <= @param key, or < with @param incl unset (e.g. the latest record before a time) */
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::floor(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size, bool incl)
+{
+	return neighbour(key, true, incl, key_buf, max_key_size, val_buf, max_val_size);
+}
+
+/* first key >= @param key, or > with @param incl unset */
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::ceil(const Key * key, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size, bool incl)
+{
+	return neighbour(key, false, incl, key_buf, max_key_size, val_buf, max_val_size);
+}
+
+/*
+* one-record cursor: the cursor already merges the unsorted region of the
+* leaf and moves on to the sibling leaf when @param key is past the last record
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::neighbour(const Key * key, bool reverse, bool incl, Key * key_buf, uint32_t max_key_size, Val * val_buf, uint32_t max_val_size)
+{
+	bz_cursor<Key, Val, Cmp> cursor(this, true, reverse);
+	cursor.seek(key);
+	if (!incl && cursor.valid() && !bz_key_compare<Key, Cmp>()(cursor.key(), key))
+		cursor.next();
+	return cursor.copy_record(key_buf, max_key_size, val_buf, max_val_size);
+}
+
+/*
+* delete every key in [@param beg, @param end), @param end == nullptr: up to the last key
+* 1. leaves whose fences lie inside the range are unlinked from their parent,
+*    RANGE_UNLINK_BATCH at a time with one new parent, their keys fall to the next child.
+*    The last child of a parent stays: it carries the parent's upper fence
+* 2. the records left (boundary leaves, last children) are deleted one by one,
+*    collected a leaf at a time
+* @return 0, or the first error of a remove() other than ENOTFOUND
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::remove_range(const Key * beg, const Key * end)
+{
+	register_this();
+	bz_key_compare<Key, Cmp> cmp;
+	if (end && cmp(beg, end) >= 0)
+		return 0;
+
+	/* sweep the parents of the leaves from left to right */
+	std::string from_buf;
+	bz_cursor<Key, Val, Cmp>::copy_bound(from_buf, beg);
+	bool from_incl = true;
+	while (true) {
+		acquire_rd();
+		uint64_t ptr = pmwcas_read(&root_);
+		if (!ptr || is_leaf_node(ptr)) {
+			release();
+			break;
+		}
+		const Key * from = (const Key*)from_buf.data();
+		/* lower fence of the parent, nullptr on the left edge of the tree */
+		const Key * lo = nullptr;
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> grandpa;
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> parent;
+		int parent_id = -1;
+		int child_id;
+		while (true) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+			child_id = (int)node->binary_search(from);
+			if (!from_incl && (uint32_t)child_id + 1 < get_record_count(pmwcas_read(&node->status_))
+				&& !cmp(node->nth_key(child_id), from))
+				++child_id;
+			uint64_t next = pmwcas_read(node->nth_val(child_id));
+			if (is_leaf_node(next)) {
+				parent = node;
+				break;
+			}
+			if (child_id > 0)
+				lo = node->nth_key(child_id - 1);
+			grandpa = node;
+			parent_id = child_id;
+			ptr = next;
+		}
+
+		int ret = 0;
+		uint64_t status_parent = pmwcas_read(&parent->status_);
+		uint32_t child_cnt = get_record_count(status_parent);
+		int first = -1;
+		int n = 0;
+		for (int i = child_id; i + 1 < (int)child_cnt && n < RANGE_UNLINK_BATCH; ++i) {
+			const Key * lo_i = i > 0 ? parent->nth_key(i - 1) : lo;
+			if (lo_i && cmp(lo_i, beg) >= 0 && (!end || cmp(parent->nth_key(i), end) < 0)) {
+				if (first < 0)
+					first = i;
+				++n;
+			}
+			else if (n) {
+				break;
+			}
+		}
+		if (is_frozen(status_parent)) {
+			ret = EFROZEN;
+		}
+		else if (n) {
+			ret = grandpa.is_null()
+				? unlink_leaves(parent, status_parent, first, n, rel_ptr<uint64_t>::null(), rel_ptr<uint64_t>::null())
+				: unlink_leaves(parent, status_parent, first, n, &grandpa->status_, grandpa->nth_val(parent_id));
+		}
+		else {
+			/* nothing more to unlink under this parent, go on past its fence */
+			const Key * fence = parent->nth_key(child_cnt - 1);
+			if (bz_codec<Key>::is_max(fence) || (end && cmp(fence, end) >= 0)) {
+				release();
+				break;
+			}
+			bz_cursor<Key, Val, Cmp>::copy_bound(from_buf, fence);
+			from_incl = false;
+		}
+		release();
+		if (ret)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	/* boundary records, a leaf at a time: the cursor is closed before remove() runs SMOs */
+	std::vector<std::string> keys;
+	bz_cursor<Key, Val, Cmp>::copy_bound(from_buf, beg);
+	from_incl = true;
+	while (true) {
+		keys.clear();
+		{
+			const Key * from = (const Key*)from_buf.data();
+			bz_cursor<Key, Val, Cmp> cursor(this);
+			cursor.seek(from, end);
+			if (!from_incl && cursor.valid() && !cmp(cursor.key(), from))
+				cursor.next();
+			uint64_t leaf = cursor.valid() ? cursor.leaf_.rel() : 0;
+			for (; cursor.valid() && cursor.leaf_.rel() == leaf; cursor.next())
+				keys.emplace_back((const char*)cursor.key(), cursor.key_size());
+		}
+		if (keys.empty())
+			break;
+		for (auto & key : keys) {
+			int ret = remove((const Key*)key.data());
+			/* ENOTFOUND: removed by someone else meanwhile */
+			if (ret && ret != ENOTFOUND)
+				return ret;
+		}
+		bz_cursor<Key, Val, Cmp>::copy_bound(from_buf, (const Key*)keys.back().data());
+		from_incl = false;
+	}
+	return 0;
+}
+
+/*
+* unlink @param n leaves from child @param first on out of @param parent:
+* 1. freeze P, so that no child pointer changes under the copy
+* 2. one PMwCAS: freeze the leaves and release them, swap P for P' without
+*    the leaves in G's child ptr (or the root) and check G's status
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::unlink_leaves(rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, uint64_t status_parent, int first, int n,
+	rel_ptr<uint64_t> grandpa_status, rel_ptr<uint64_t> grandpa_ptr)
+{
+	mdesc_t mdesc = alloc_mdesc();
+	if (mdesc.is_null())
+		return EPMWCASALLOC;
+
+	uint64_t status_grandpa_rd = 0;
+	if (!grandpa_ptr.is_null()) {
+		status_grandpa_rd = pmwcas_read(grandpa_status.abs());
+		if (is_frozen(status_grandpa_rd)) {
+			pmwcas_abort(mdesc);
+			return EFROZEN;
+		}
+	}
+	/* freeze P before reading its children and copying it, see merge(); unfrozen again if mdesc fails */
+	uint64_t status_parent_new = parent->status_frozen(status_parent);
+	int cas_res = pack_pmwcas({ { &parent->status_, status_parent, status_parent_new } });
+	if (cas_res) {
+		pmwcas_abort(mdesc);
+		return cas_res == EPMWCASALLOC ? EPMWCASALLOC : EFROZEN;
+	}
+	pmwcas_add(mdesc, &parent->status_, status_parent_new, status_parent, NOCAS_EXECUTE_ON_FAILED);
+
+	rel_ptr<bz_node<Key, Val, Cmp>> leaves[RANGE_UNLINK_BATCH];
+	for (int i = 0; i < n; ++i) {
+		leaves[i] = rel_ptr<bz_node<Key, Val, Cmp>>(pmwcas_read(parent->nth_val(first + i)));
+		uint64_t status_rd = pmwcas_read(&leaves[i]->status_);
+		if (is_frozen(status_rd)) {
+			pmwcas_free(mdesc);
+			return EFROZEN;
+		}
+		pmwcas_add(mdesc, &leaves[i]->status_, status_rd, leaves[i]->status_frozen(status_rd));
+	}
+
+	/* P' */
+	rel_ptr<bz_node<Key, uint64_t, Cmp>> new_parent = *alloc_node<uint64_t>(mdesc, 0);
+	uint32_t new_parent_rec_cnt = parent->copy_node_to(new_parent, status_parent) - n;
+	for (int i = n - 1; i >= 0; --i)
+		new_parent->fr_remove_meta(first + i);
+	set_sorted_count(new_parent->length_, new_parent_rec_cnt);
+	new_parent->fr_build_prefixes();
+	persist(new_parent.abs(), NODE_ALLOC_SIZE);
+
+	if (grandpa_ptr.is_null()) {
+		pmwcas_add(mdesc, &root_, parent.rel(), new_parent.rel(), RELEASE_EXP_ON_SUCCESS);
+	}
+	else {
+		pmwcas_add(mdesc, grandpa_ptr, parent.rel(), new_parent.rel(), RELEASE_EXP_ON_SUCCESS);
+		pmwcas_add(mdesc, grandpa_status, status_grandpa_rd, status_grandpa_rd);
+	}
+	for (int i = 0; i < n; ++i)
+		pmwcas_add(mdesc, rel_ptr<uint64_t>((uint64_t*)leaves[i].abs()), 0, 0, NOCAS_RELEASE_ADDR_ON_SUCCESS);
+
+	int ret = 0;
+	{
+		/* the leaves are gone from the index before they go to G/C */
+		auto dram_guard = lock_dram_index();
+		if (!pmwcas_commit(mdesc)) {
+			ret = ERACE;
+		}
+		else if (dram_) {
+			for (int i = 0; i < n; ++i)
+				dram_->merge(leaves[i].rel(), 0, 0);
+		}
+	}
+	pmwcas_free(mdesc);
+	return ret;
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::multi_insert(bz_write_op<Key, Val> * ops, uint32_t n)
+{
+	return multi_write(ops, n, false);
+}
+
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::multi_upsert(bz_write_op<Key, Val> * ops, uint32_t n)
+{
+	return multi_write(ops, n, true);
+}
+
+/*
+* batched insert / upsert: the ops are sorted and the run of keys falling
+* into the same leaf is written with bz_node::write_batch.
+* Whatever the batch can not do (SMO due, frozen leaf, PMwCAS pool empty)
+* goes through the single-key path one op at a time.
+* @return 0, the result of every op is in its ret
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::multi_write(bz_write_op<Key, Val> * ops, uint32_t n, bool upsert)
+{
+	register_this();
+	if (!pmwcas_read(&root_)) {
+		new_root();
+	}
+	/* stable: a key given twice is written in the caller's order */
+	std::vector<bz_write_op<Key, Val> *> sorted;
+	for (uint32_t i = 0; i < n; ++i) {
+		if (valid_value(ops[i].val, ops[i].total_size - ops[i].key_size))
+			sorted.push_back(&ops[i]);
+		else
+			ops[i].ret = EVALUE;
+	}
+	n = (uint32_t)sorted.size();
+	std::stable_sort(sorted.begin(), sorted.end(), [](bz_write_op<Key, Val> * a, bz_write_op<Key, Val> * b) {
+		return bz_key_compare<Key, Cmp>()(a->key, b->key) < 0;
+	});
+
+	uint32_t beg = 0;
+	while (beg < n)
+	{
+		acquire_rd();
+		/* the leaf of the first pending key, and its fence */
+		uint64_t ptr = pmwcas_read(&root_);
+		const Key * fence = nullptr;
+		while (!is_leaf_node(ptr)) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+			int child_id = (int)node->binary_search(sorted[beg]->key);
+			fence = node->nth_key(child_id);
+			ptr = pmwcas_read(node->nth_val(child_id));
+		}
+		uint32_t end = beg + 1;
+		while (end < n && (!fence || bz_key_compare<Key, Cmp>()(sorted[end]->key, fence) <= 0))
+			++end;
+
+		rel_ptr<bz_node<Key, Val, Cmp>> leaf(ptr);
+		uint32_t done = 0;
+		int ret = leaf->triger_consolidate() ? EALLOCSIZE
+			: leaf->write_batch(this, &sorted[beg], end - beg, upsert, epoch_, done);
+		release();
+
+		if (ret) {
+			bz_write_op<Key, Val> * op = sorted[beg];
+			op->ret = upsert ? this->upsert(op->key, op->val, op->key_size, op->total_size)
+				: insert(op->key, op->val, op->key_size, op->total_size);
+			done = 1;
+		}
+		beg += done;
+	}
+	return 0;
 }
 
-template<typename Key, typename Val>
-inline int bz_tree<Key, Val>::insert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::atomic_insert(bz_write_op<Key, Val> * ops, uint32_t n)
 {
-	return traverse(BZ_ACTION_INSERT, true, key, val, key_size, total_size);
+	return atomic_write(ops, n, false);
 }
 
-template<typename Key, typename Val>
-inline int bz_tree<Key, Val>::remove(const Key * key)
+template<typename Key, typename Val, typename Cmp>
+inline int bz_tree<Key, Val, Cmp>::atomic_upsert(bz_write_op<Key, Val> * ops, uint32_t n)
 {
-	return traverse(BZ_ACTION_DELETE, true, key);
+	return atomic_write(ops, n, true);
 }
 
-template<typename Key, typename Val>
-inline int bz_tree<Key, Val>::update(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+/*
+* all-or-nothing insert / upsert of @param n ops, across leaves:
+* the records are reserved leaf by leaf in key order (bz_node::reserve_batch),
+* then one PMwCAS over every leaf status, the replaced metas and the new
+* metas publishes them together. A frozen leaf, a lost race (the PMwCAS
+* failing ATOMIC_PUBLISH_TRIES times) or an empty PMwCAS pool drops the
+* reserved records, leaves the epoch and starts over after a back-off of at
+* most RETRY_MAX_MS; a leaf due for an SMO gets it first.
+* The PMwCAS bounds the batch: one word per leaf, one per op and one more
+* per replaced record, WORD_DESCRIPTOR_SIZE in all.
+* @return 0, EUNIKEY (a key given twice, or present for an insert),
+* EBATCHSIZE, EALLOCSIZE if a leaf can not hold its share, EVALUE (see valid_value);
+* copied to every ret
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::atomic_write(bz_write_op<Key, Val> * ops, uint32_t n, bool upsert)
 {
-	return traverse(BZ_ACTION_UPDATE, true, key, val, key_size, total_size);
+	register_this();
+	if (!pmwcas_read(&root_)) {
+		new_root();
+	}
+	std::vector<bz_write_op<Key, Val> *> sorted(n);
+	for (uint32_t i = 0; i < n; ++i)
+		sorted[i] = &ops[i];
+	std::sort(sorted.begin(), sorted.end(), [](bz_write_op<Key, Val> * a, bz_write_op<Key, Val> * b) {
+		return bz_key_compare<Key, Cmp>()(a->key, b->key) < 0;
+	});
+
+	int ret = n + 1 > WORD_DESCRIPTOR_SIZE ? EBATCHSIZE : 0;
+	for (uint32_t i = 1; i < n && !ret; ++i)
+		if (!bz_key_compare<Key, Cmp>()(sorted[i - 1]->key, sorted[i]->key))
+			ret = EUNIKEY;
+	for (uint32_t i = 0; i < n && !ret; ++i)
+		if (!valid_value(ops[i].val, ops[i].total_size - ops[i].key_size))
+			ret = EVALUE;
+
+	std::vector<int> del_pos(n);
+	std::vector<uint32_t> new_offset(n);
+	/* leaf, its first op, its first reserved meta entry */
+	std::vector<std::tuple<uint64_t, uint32_t, uint32_t>> groups;
+	std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn;
+	int retry = 0;
+	while (!ret && n)
+	{
+		acquire_rd();
+		groups.clear();
+		const Key * smo_key = nullptr;
+		int smo_type = 0;
+		for (uint32_t beg = 0; beg < n && !smo_type; ) {
+			uint64_t ptr = pmwcas_read(&root_);
+			const Key * fence = nullptr;
+			while (!is_leaf_node(ptr)) {
+				rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+				int child_id = (int)node->binary_search(sorted[beg]->key);
+				fence = node->nth_key(child_id);
+				ptr = pmwcas_read(node->nth_val(child_id));
+			}
+			smo_type = rel_ptr<bz_node<Key, Val, Cmp>>(ptr)->triger_consolidate();
+			smo_key = sorted[beg]->key;
+			groups.emplace_back(ptr, beg, 0);
+			while (++beg < n && (!fence || bz_key_compare<Key, Cmp>()(sorted[beg]->key, fence) <= 0));
+		}
+		if (smo_type) {
+			release();
+			/* a write descent runs the SMOs due on the path of the key */
+			if (smo_type != BZ_FROZEN)
+				traverse(BZ_ACTION_READ, true, smo_key);
+			else
+				std::this_thread::sleep_for(std::chrono::milliseconds(std::min(++retry, RETRY_MAX_MS)));
+			continue;
+		}
+		if (groups.size() + n > WORD_DESCRIPTOR_SIZE) {
+			release();
+			ret = EBATCHSIZE;
+			break;
+		}
+
+		/* reserve */
+		size_t reserved = 0;
+		for (; reserved < groups.size(); ++reserved) {
+			rel_ptr<bz_node<Key, Val, Cmp>> leaf(std::get<0>(groups[reserved]));
+			uint32_t beg = std::get<1>(groups[reserved]);
+			uint32_t end = reserved + 1 < groups.size() ? std::get<1>(groups[reserved + 1]) : n;
+			ret = leaf->reserve_batch(this, &sorted[beg], end - beg, upsert, epoch_, &del_pos[beg], &new_offset[beg], std::get<2>(groups[reserved]));
+			if (ret)
+				break;
+		}
+
+		/* publish: a failed PMwCAS retries at once, the words are re-read */
+		for (int tries = 1; !ret; ++tries)
+		{
+			casn.clear();
+			for (size_t g = 0; g < groups.size() && !ret; ++g) {
+				rel_ptr<bz_node<Key, Val, Cmp>> leaf(std::get<0>(groups[g]));
+				uint32_t beg = std::get<1>(groups[g]);
+				uint32_t end = g + 1 < groups.size() ? std::get<1>(groups[g + 1]) : n;
+				ret = leaf->publish_batch_words(&sorted[beg], end - beg, epoch_, &del_pos[beg], &new_offset[beg], std::get<2>(groups[g]), casn);
+			}
+			if (!ret && casn.size() > WORD_DESCRIPTOR_SIZE)
+				ret = EBATCHSIZE;
+			if (ret)
+				break;
+			int cas_res = pack_pmwcas(casn);
+			if (!cas_res)
+				break;
+			if (EPMWCASALLOC == cas_res)
+				ret = EPMWCASALLOC;
+			else if (tries >= ATOMIC_PUBLISH_TRIES)
+				ret = ERACE;	/* drop the records, back off out of the epoch */
+		}
+
+		if (ret) {
+			for (size_t g = 0; g < reserved; ++g) {
+				rel_ptr<bz_node<Key, Val, Cmp>> leaf(std::get<0>(groups[g]));
+				uint32_t beg = std::get<1>(groups[g]);
+				uint32_t end = g + 1 < groups.size() ? std::get<1>(groups[g + 1]) : n;
+				leaf->drop_batch(this, &sorted[beg], end - beg, std::get<2>(groups[g]));
+			}
+		}
+		release();
+		if (ret == EFROZEN || ret == ERACE || ret == EPMWCASALLOC) {
+			ret = 0;
+			std::this_thread::sleep_for(std::chrono::milliseconds(std::min(++retry, RETRY_MAX_MS)));
+			continue;
+		}
+		break;
+	}
+	for (uint32_t i = 0; i < n; ++i)
+		ops[i].ret = ret;
+	return ret;
 }
 
-template<typename Key, typename Val>
-inline int bz_tree<Key, Val>::upsert(const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+/*
+* build the tree bottom-up from @param n records sorted by key:
+* leaves are packed up to @param fill of their usable space and
+* every inner level is laid on top of the previous one.
+* The nodes stay detached until one PMwCAS installs the new root,
+* which requires the tree to be empty (no root, or an empty root leaf).
+* A crash before that PMwCAS leaks the detached nodes, never the tree.
+* @param threads: the input is cut into as many key ranges, whose leaves
+* are built in parallel and chained in order under the shared inner levels
+* (one thread when it is < 1 or more than @param n)
+* @return EUNIKEY / EUNSORTED / EVALUE (see valid_value) for bad input,
+* EVALUE for a @param fill out of (0, 1], ERACE if the tree is not empty
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::bulk_load(const bz_write_op<Key, Val> * ops, uint32_t n, float fill, int threads)
 {
-	return traverse(BZ_ACTION_UPSERT, true, key, val, key_size, total_size);
+	register_this();
+	if (!n)
+		return 0;
+	if (!(fill > 0 && fill <= 1))
+		return EVALUE;
+	if (threads < 1 || (uint32_t)threads > n)
+		threads = 1;
+	for (uint32_t i = 0; i < n; ++i)
+		if (!valid_value(ops[i].val, ops[i].total_size - ops[i].key_size))
+			return EVALUE;
+	uint32_t hdr_sz = sizeof(bz_node<Key, Val, Cmp>);
+	uint32_t limit = hdr_sz + (uint32_t)(fill * (NODE_ALLOC_SIZE - NODE_MIN_FREE_SIZE - 1 - hdr_sz));
+
+	int ret = 0;
+	mdesc_t mdesc;
+	std::vector<uint64_t> nodes;
+	std::vector<uint64_t> level;
+
+	/* leaves, one key range per thread */
+	std::vector<std::vector<uint64_t>> part_nodes(threads), part_leaves(threads);
+	std::vector<int> part_ret(threads);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t) {
+		workers.emplace_back([&, t] {
+			uint32_t beg = (uint32_t)((uint64_t)n * t / threads);
+			uint32_t end = (uint32_t)((uint64_t)n * (t + 1) / threads);
+			part_ret[t] = bulk_build_leaves(ops + beg, end - beg, limit, part_nodes[t], part_leaves[t]);
+		});
+	}
+	for (auto & w : workers)
+		w.join();
+	for (int t = 0; t < threads; ++t) {
+		if (!ret)
+			ret = part_ret[t];
+		/* the order across the cut */
+		if (!ret && t) {
+			uint32_t cut = (uint32_t)((uint64_t)n * t / threads);
+			int cmp = bz_key_compare<Key, Cmp>()(ops[cut - 1].key, ops[cut].key);
+			if (cmp >= 0)
+				ret = cmp ? EUNSORTED : EUNIKEY;
+		}
+		nodes.insert(nodes.end(), part_nodes[t].begin(), part_nodes[t].end());
+		level.insert(level.end(), part_leaves[t].begin(), part_leaves[t].end());
+	}
+
+	/* inner levels: the separator of a child is its last key, BZ_KEY_MAX for the rightmost one */
+	while (!ret && level.size() > 1) {
+		std::vector<uint64_t> upper;
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> node;
+		for (size_t i = 0; !ret && i < level.size(); ++i) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>> child(level[i]);
+			uint64_t last_meta = child->rec_meta_arr()[get_record_count(child->status_) - 1];
+			bool rightmost = i + 1 == level.size();
+			const Key * sep = rightmost ? (const Key*)&BZ_KEY_MAX : child->get_key(last_meta);
+			uint32_t key_sz = rightmost ? sizeof(uint64_t) : get_key_length(last_meta);
+			uint32_t tot_sz = key_sz + sizeof(uint64_t);
+			if (!node.is_null() && !node->fr_append_meta(sep, &level[i], key_sz, tot_sz, limit))
+				continue;
+			node = bulk_alloc<uint64_t>(mdesc, nodes);
+			if (node.is_null()) {
+				ret = EPMWCASALLOC;
+				break;
+			}
+			set_non_leaf(node->length_);
+			upper.push_back(node.rel());
+			ret = node->fr_append_meta(sep, &level[i], key_sz, tot_sz, limit);
+		}
+		for (uint64_t ptr : upper) {
+			rel_ptr<bz_node<Key, uint64_t, Cmp>>(ptr)->fr_build_prefixes();
+			persist(rel_ptr<uint64_t>(ptr).abs(), NODE_ALLOC_SIZE);
+		}
+		level.swap(upper);
+	}
+
+	if (!mdesc.is_null()) {
+		pmwcas_commit(mdesc);
+		pmwcas_free(mdesc);
+	}
+
+	/* install: replace the missing or empty root, freezing the latter */
+	if (!ret) {
+		acquire_rd();
+		uint64_t root = pmwcas_read(&root_);
+		rel_ptr<bz_node<Key, Val, Cmp>> old_root(root);
+		uint64_t status_rd = root ? pmwcas_read(&old_root->status_) : 0;
+		if (root && (!is_leaf_node(root) || is_frozen(status_rd) || old_root->valid_record_count(status_rd)))
+			ret = ERACE;
+		else if ((mdesc = alloc_mdesc()).is_null())
+			ret = EPMWCASALLOC;
+		else {
+			if (root)
+				pmwcas_add(mdesc, &old_root->status_, status_rd, old_root->status_frozen(status_rd));
+			pmwcas_add(mdesc, &root_, root, level[0], root ? RELEASE_EXP_ON_SUCCESS : 0);
+			{
+				/* the old root leaf leaves the index with the commit, the new leaves come with the rebuild */
+				auto dram_guard = lock_dram_index();
+				if (!pmwcas_commit(mdesc))
+					ret = ERACE;
+				else if (dram_)
+					dram_->invalidate();
+			}
+			pmwcas_free(mdesc);
+		}
+		release();
+	}
+	if (ret)
+		bulk_release(nodes);
+	else if (dram_)
+		rebuild_dram_index();
+	return ret;
 }
 
-template<typename Key, typename Val>
-inline int bz_tree<Key, Val>::read(const Key * key, Val * buffer, uint32_t max_val_size)
+/*
+* pack the sorted @param ops into new leaves, appended to @param leaves;
+* every node allocated is recorded in @param nodes
+*/
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::bulk_build_leaves(const bz_write_op<Key, Val> * ops, uint32_t n, uint32_t limit, std::vector<uint64_t> & nodes, std::vector<uint64_t> & leaves)
 {
-	return traverse(BZ_ACTION_READ, false, key, nullptr, 0, 0, buffer, max_val_size);
+	int ret = 0;
+	mdesc_t mdesc;
+	rel_ptr<bz_node<Key, Val, Cmp>> leaf;
+	for (uint32_t i = 0; !ret && i < n; ++i) {
+		const bz_write_op<Key, Val> & op = ops[i];
+		if (i) {
+			int cmp = bz_key_compare<Key, Cmp>()(ops[i - 1].key, op.key);
+			if (cmp >= 0) {
+				ret = cmp ? EUNSORTED : EUNIKEY;
+				break;
+			}
+		}
+		if (!leaf.is_null() && !leaf->fr_append_meta(op.key, op.val, op.key_size, op.total_size, limit))
+			continue;
+		if (!leaf.is_null()) {
+			leaf->fr_build_prefixes();
+			persist(leaf.abs(), NODE_ALLOC_SIZE);
+		}
+		leaf = bulk_alloc<Val>(mdesc, nodes);
+		if (leaf.is_null()) {
+			ret = EPMWCASALLOC;
+			break;
+		}
+		set_leaf(leaf->length_);
+		leaves.push_back(leaf.rel());
+		ret = leaf->fr_append_meta(op.key, op.val, op.key_size, op.total_size, limit);
+	}
+	if (!leaf.is_null()) {
+		leaf->fr_build_prefixes();
+		persist(leaf.abs(), NODE_ALLOC_SIZE);
+	}
+	if (!mdesc.is_null()) {
+		pmwcas_commit(mdesc);
+		pmwcas_free(mdesc);
+	}
+	return ret;
 }
 
-template<typename Key, typename Val>
-int bz_tree<Key, Val>::new_root() {
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::new_root() {
 	mdesc_t mdesc = alloc_mdesc();
 	if (mdesc.is_null())
 		return EPMWCASALLOC;
-	rel_ptr<rel_ptr<bz_node<Key, Val>>> new_node_ptr = alloc_node<Val>(mdesc);
-	rel_ptr<bz_node<Key, Val>> new_node = *new_node_ptr;
+	rel_ptr<rel_ptr<bz_node<Key, Val, Cmp>>> new_node_ptr = alloc_node<Val>(mdesc);
+	rel_ptr<bz_node<Key, Val, Cmp>> new_node = *new_node_ptr;
 
 	pmwcas_add(mdesc, &root_, 0, new_node.rel(), RELEASE_NEW_ON_FAILED);
 
 	int ret = 0;
-	if (!pmwcas_commit(mdesc))
-		ret = ERACE;
+	{
+		auto dram_guard = lock_dram_index();
+		if (!pmwcas_commit(mdesc))
+			ret = ERACE;
+		else if (dram_)
+			dram_->add((const Key*)&BZ_KEY_MAX, sizeof(uint64_t), new_node.rel());
+	}
 
 	pmwcas_free(mdesc);
 	
@@ -2026,12 +4020,78 @@ int bz_tree<Key, Val>::new_root() {
 	return ret;
 }
 
+/* held across the PMwCAS commit of an SMO that replaces leaves (@param leaf) and the index update */
+template<typename Key, typename Val, typename Cmp>
+inline std::unique_lock<std::shared_timed_mutex> bz_tree<Key, Val, Cmp>::lock_dram_index(bool leaf)
+{
+	if (!dram_ || !leaf)
+		return std::unique_lock<std::shared_timed_mutex>();
+	return dram_->lock_smo();
+}
+
+/*
+* rebuild the DRAM index from the leaves, outside any critical section,
+* with @param stale_only only if an update missed (see bz_dram_index)
+* the root's subtrees are scanned in parallel, one slice per thread.
+* The lock holds back every leaf SMO commit meanwhile, so the leaves collected
+* are the ones of the tree; inner SMOs only move them around
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::rebuild_dram_index(bool stale_only)
+{
+	auto dram_guard = lock_dram_index();
+	/* another thread got there first */
+	if (stale_only && !dram_->stale())
+		return;
+	typename dram_index_t::leaf_list leaves;
+	register_this();
+	acquire_rd();
+	uint64_t root = pmwcas_read(&root_);
+	if (root && is_leaf_node(root)) {
+		leaves.emplace_back(dram_index_t::make_fence((const Key*)&BZ_KEY_MAX, sizeof(uint64_t)), root);
+	}
+	else if (root) {
+		rel_ptr<bz_node<Key, uint64_t, Cmp>> node(root);
+		uint32_t child_cnt = get_record_count(pmwcas_read(&node->status_));
+		std::vector<typename dram_index_t::leaf_list> parts(REBUILD_THREADS_COUNT);
+		std::vector<std::thread> workers;
+		for (int t = 0; t < REBUILD_THREADS_COUNT; ++t) {
+			workers.emplace_back([&, t] {
+				for (uint32_t i = t; i < child_cnt; i += REBUILD_THREADS_COUNT)
+					collect_leaves(node, i, parts[t]);
+			});
+		}
+		for (auto & w : workers)
+			w.join();
+		for (auto & part : parts)
+			leaves.insert(leaves.end(), part.begin(), part.end());
+	}
+	release();
+	dram_->reset(leaves);
+}
+
+/* collect <fence, leaf> under the @param n th child of @param parent */
+template<typename Key, typename Val, typename Cmp>
+void bz_tree<Key, Val, Cmp>::collect_leaves(rel_ptr<bz_node<Key, uint64_t, Cmp>> parent, uint32_t n, typename dram_index_t::leaf_list & leaves)
+{
+	uint64_t meta_rd = pmwcas_read(parent->rec_meta_arr() + n);
+	uint64_t ptr = *parent->get_value(meta_rd);
+	if (is_leaf_node(ptr)) {
+		leaves.emplace_back(dram_index_t::make_fence(parent->get_key(meta_rd), get_key_length(meta_rd)), ptr);
+		return;
+	}
+	rel_ptr<bz_node<Key, uint64_t, Cmp>> node(ptr);
+	uint32_t child_cnt = get_record_count(pmwcas_read(&node->status_));
+	for (uint32_t i = 0; i < child_cnt; ++i)
+		collect_leaves(node, i, leaves);
+}
+
 /*
 * ڼֵ洢ֲ @param key
 * ؽbool λ @param pos
 */
-template<typename Key, typename Val>
-bool bz_node<Key, Val>::find_key_sorted(const Key * key, uint32_t &pos)
+template<typename Key, typename Val, typename Cmp>
+bool bz_node<Key, Val, Cmp>::find_key_sorted(const Key * key, uint32_t &pos)
 {
 	uint64_t * meta_arr = rec_meta_arr();
 	uint32_t sorted_cnt = get_sorted_count(length_);
@@ -2051,24 +4111,32 @@ bool bz_node<Key, Val>::find_key_sorted(const Key * key, uint32_t &pos)
 * λ @param pos
 * Ա־ @param recheck
 */
-template<typename Key, typename Val>
-bool bz_node<Key, Val>::find_key_unsorted(const Key * key, uint64_t status_rd, uint32_t alloc_epoch, uint32_t &pos, bool &retry)
+template<typename Key, typename Val, typename Cmp>
+bool bz_node<Key, Val, Cmp>::find_key_unsorted(const Key * key, uint64_t status_rd, uint32_t alloc_epoch, uint32_t &pos, bool &retry)
 {
 	uint64_t * meta_arr = rec_meta_arr();
 	uint32_t sorted_cnt = get_sorted_count(length_);
 	uint32_t rec_cnt = get_record_count(status_rd);
+	uint8_t fp = bz_key_fingerprint<Key, Cmp>()(key);
 	bool ret = false;
-	for (uint32_t i = sorted_cnt; i < rec_cnt; ++i)
+	for (uint32_t blk = sorted_cnt; blk < rec_cnt; blk += BZ_META_SCAN_MAX)
 	{
-		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
-		if (is_visiable(meta_rd)) {
-			if (!key_cmp(meta_rd, key)) {
-				pos = i;
-				ret = true;
+		bz_meta_masks m;
+		bz_meta_scan(meta_arr + blk, std::min(rec_cnt - blk, BZ_META_SCAN_MAX), alloc_epoch, m);
+		for (uint64_t bits = m.ctrl | m.visible | m.pending; bits; bits &= bits - 1) {
+			uint32_t i = blk + bz_ctz64(bits);
+			if (fingerprint_mismatch(i, sorted_cnt, fp))
+				continue;
+			uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
+			if (is_visiable(meta_rd)) {
+				if (!key_cmp(meta_rd, key)) {
+					pos = i;
+					ret = true;
+				}
 			}
+			else if (!retry && get_offset(meta_rd) == alloc_epoch)
+				retry = true;
 		}
-		else if (!retry && get_offset(meta_rd) == alloc_epoch)
-			retry = true;
 	}
 	return ret;
 }
@@ -2077,8 +4145,8 @@ bool bz_node<Key, Val>::find_key_unsorted(const Key * key, uint64_t status_rd, u
 * block_size @param total_size
 * ״̬uint64_t
 */
-template<typename Key, typename Val>
-uint64_t bz_node<Key, Val>::status_add_rec_blk(uint64_t status_rd, uint32_t total_size)
+template<typename Key, typename Val, typename Cmp>
+uint64_t bz_node<Key, Val, Cmp>::status_add_rec_blk(uint64_t status_rd, uint32_t total_size)
 {
 	uint32_t rec_cnt = get_record_count(status_rd);
 	uint32_t blk_sz = get_block_size(status_rd);
@@ -2090,16 +4158,16 @@ uint64_t bz_node<Key, Val>::status_add_rec_blk(uint64_t status_rd, uint32_t tota
 * Ϊmeta_entry @param meta_rd delete-sizeС
 * meta_entry uint64_t
 */
-template<typename Key, typename Val>
-uint64_t bz_node<Key, Val>::status_del(uint64_t status_rd, uint32_t total_size)
+template<typename Key, typename Val, typename Cmp>
+uint64_t bz_node<Key, Val, Cmp>::status_del(uint64_t status_rd, uint32_t total_size)
 {
 	uint32_t dele_sz = get_delete_size(status_rd);
 	set_delete_size(status_rd, dele_sz + total_size);
 	return status_rd;
 }
-template<typename Key, typename Val>
+template<typename Key, typename Val, typename Cmp>
 template<typename TreeVal>
-inline bool bz_node<Key, Val>::add_dele_sz(bz_tree<Key, TreeVal> * tree, uint32_t total_size)
+inline bool bz_node<Key, Val, Cmp>::add_dele_sz(bz_tree<Key, TreeVal, Cmp> * tree, uint32_t total_size)
 {
 	while (true) {
 		uint64_t status_rd = pmwcas_read(&status_);
@@ -2113,8 +4181,8 @@ inline bool bz_node<Key, Val>::add_dele_sz(bz_tree<Key, TreeVal> * tree, uint32_
 			return false;
 	}
 }
-template<typename Key, typename Val>
-inline uint64_t bz_node<Key, Val>::status_frozen(uint64_t status_rd)
+template<typename Key, typename Val, typename Cmp>
+inline uint64_t bz_node<Key, Val, Cmp>::status_frozen(uint64_t status_rd)
 {
 	set_frozen(status_rd);
 	return status_rd;
@@ -2125,8 +4193,8 @@ inline uint64_t bz_node<Key, Val>::status_frozen(uint64_t status_rd)
 * @param new_offset µoffset
 * meta_entry uint64_t
 */
-template<typename Key, typename Val>
-uint64_t bz_node<Key, Val>::meta_vis_off(uint64_t meta_rd, bool set_vis, uint32_t new_offset)
+template<typename Key, typename Val, typename Cmp>
+uint64_t bz_node<Key, Val, Cmp>::meta_vis_off(uint64_t meta_rd, bool set_vis, uint32_t new_offset)
 {
 	if (set_vis)
 		set_visiable(meta_rd);
@@ -2143,8 +4211,8 @@ uint64_t bz_node<Key, Val>::meta_vis_off(uint64_t meta_rd, bool set_vis, uint32_
 * @param total_size ܳ
 * meta_entry uint64_t
 */
-template<typename Key, typename Val>
-uint64_t bz_node<Key, Val>::meta_vis_off_klen_tlen(uint64_t meta_rd, bool set_vis, uint32_t new_offset, uint32_t key_size, uint32_t total_size)
+template<typename Key, typename Val, typename Cmp>
+uint64_t bz_node<Key, Val, Cmp>::meta_vis_off_klen_tlen(uint64_t meta_rd, bool set_vis, uint32_t new_offset, uint32_t key_size, uint32_t total_size)
 {
 	if (set_vis)
 		set_visiable(meta_rd);
@@ -2159,64 +4227,92 @@ uint64_t bz_node<Key, Val>::meta_vis_off_klen_tlen(uint64_t meta_rd, bool set_vi
 * key valueblock storage
 * @param new_offset: ڵͷƫ
 */
-template<typename Key, typename Val>
-void bz_node<Key, Val>::copy_data(uint32_t new_offset, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::copy_data(uint32_t new_offset, const Key * key, const Val * val, uint32_t key_size, uint32_t total_size)
 {
-	set_key(new_offset, key);
-	set_value(new_offset + key_size, val);
+	set_key(new_offset, key, key_size);
+	set_value(new_offset + key_size, val, total_size - key_size);
 	persist((char *)this + new_offset, total_size);
 }
-/* ṹݵûռ */
-template<typename Key, typename Val>
-void bz_node<Key, Val>::copy_data(uint64_t meta_rd, std::vector<std::pair<std::shared_ptr<Key>, std::shared_ptr<Val>>> & res)
+/*
+* ɨֵ */
+template<typename Key, typename Val, typename Cmp>
+template<typename TreeVal>
+int bz_node<Key, Val, Cmp>::rescan_unsorted(bz_tree<Key, TreeVal, Cmp>*tree, uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t total_size, uint32_t alloc_epoch)
 {
-	shared_ptr<Key> sp_key;
-	if (typeid(Key) == typeid(char)) {
-		sp_key = shared_ptr<Key>(new Key[get_key_length(meta_rd)], [](Key *p) {delete[] p; });
-		copy_key(sp_key.get(), get_key(meta_rd));
-	}
-	else {
-		sp_key = make_shared<Key>(*get_key(meta_rd));
-	}
-	shared_ptr<Val> sp_val;
-	if (typeid(Val) == typeid(char)) {
-		uint32_t val_sz = get_total_length(meta_rd) - get_key_length(meta_rd);
-		sp_val = shared_ptr<Val>(new Val[val_sz], [](Val *p) {delete[] p; });
-		copy_value(sp_val.get(), get_value(meta_rd));
-	}
-	else {
-		sp_val = make_shared<Val>(*get_value(meta_rd));
+	uint64_t * meta_arr = rec_meta_arr();
+	if (find_dup_unsorted(beg_pos, rec_cnt, key, alloc_epoch)) {
+		set_offset(meta_arr[rec_cnt], 0);
+		persist(&meta_arr[rec_cnt], sizeof(uint64_t));
+		if (!add_dele_sz(tree, total_size))
+			return EFROZEN;
+		return EUNIKEY;
 	}
-	res.emplace_back(make_pair(sp_key, sp_val));
+	return 0;
 }
 /*
-* ɨֵ */
-template<typename Key, typename Val>
-template<typename TreeVal>
-int bz_node<Key, Val>::rescan_unsorted(bz_tree<Key, TreeVal>*tree, uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t total_size, uint32_t alloc_epoch)
+* look for a visible copy of @param key in [beg_pos, rec_cnt),
+* waiting for the inserts of the same epoch still in progress there
+*/
+template<typename Key, typename Val, typename Cmp>
+bool bz_node<Key, Val, Cmp>::find_dup_unsorted(uint32_t beg_pos, uint32_t rec_cnt, const Key * key, uint32_t alloc_epoch)
 {
 	uint64_t * meta_arr = rec_meta_arr();
-	uint32_t i = beg_pos;
-	while (i < rec_cnt)
+	uint32_t sorted_cnt = get_sorted_count(length_);
+	uint8_t fp = bz_key_fingerprint<Key, Cmp>()(key);
+	for (uint32_t blk = beg_pos; blk < rec_cnt; blk += BZ_META_SCAN_MAX)
 	{
-		uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
-		if (is_visiable(meta_rd)) {
-			if (!key_cmp(meta_rd, key)) {
-				set_offset(meta_arr[rec_cnt], 0);
-				persist(&meta_arr[rec_cnt], sizeof(uint64_t));
-				if (!add_dele_sz(tree, total_size))
-					return EFROZEN;
-				return EUNIKEY;
+		bz_meta_masks m;
+		bz_meta_scan(meta_arr + blk, std::min(rec_cnt - blk, BZ_META_SCAN_MAX), alloc_epoch, m);
+		for (uint64_t bits = m.ctrl | m.visible | m.pending; bits; bits &= bits - 1) {
+			uint32_t i = blk + bz_ctz64(bits);
+			if (fingerprint_mismatch(i, sorted_cnt, fp))
+				continue;
+			while (true) {
+				uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
+				if (is_visiable(meta_rd)) {
+					if (!key_cmp(meta_rd, key))
+						return true;
+				}
+				else if (get_offset(meta_rd) == alloc_epoch) {
+					// ǱڵUNIKEYȴ
+					std::this_thread::sleep_for(std::chrono::milliseconds(1));
+					continue;
+				}
+				break;
 			}
 		}
-		else if (get_offset(meta_rd) == alloc_epoch) {
-			// ǱڵUNIKEYȴ
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
-			continue;
-		}
-		++i;
 	}
-	return 0;
+	return false;
+}
+/* record the fingerprint of @param key for the unsorted slot @param pos */
+template<typename Key, typename Val, typename Cmp>
+inline void bz_node<Key, Val, Cmp>::set_fingerprint(uint32_t pos, const Key * key)
+{
+	uint32_t i = pos - get_sorted_count(length_);
+	if (i < NODE_FINGERPRINTS)
+		fingerprints_[i] = bz_key_fingerprint<Key, Cmp>()(key);
+}
+/* flush the fingerprints of slots [pos, pos + n), before the PMwCAS that shows them */
+template<typename Key, typename Val, typename Cmp>
+inline void bz_node<Key, Val, Cmp>::persist_fingerprints(uint32_t pos, uint32_t n)
+{
+	uint32_t i = pos - get_sorted_count(length_);
+	if (i < NODE_FINGERPRINTS)
+		persist(&fingerprints_[i], std::min(n, NODE_FINGERPRINTS - i));
+}
+/*
+* slot @param pos holds (or is about to hold) a key other than the one of @param fp,
+* false when unsure: a slot past the array, in the sorted region or not written yet
+*/
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_node<Key, Val, Cmp>::fingerprint_mismatch(uint32_t pos, uint32_t sorted_cnt, uint8_t fp)
+{
+	uint32_t i = pos - sorted_cnt;
+	if (i >= NODE_FINGERPRINTS)
+		return false;
+	uint8_t slot_fp = ((volatile uint8_t*)fingerprints_)[i];
+	return slot_fp && slot_fp != fp;
 }
 
 /*
@@ -2224,15 +4320,24 @@ int bz_node<Key, Val>::rescan_unsorted(bz_tree<Key, TreeVal>*tree, uint32_t beg_
 * ն£̽ҵǿնԪ
 * keyΪգ˺ڲmetaеķǿmetaĸ
 */
-template<typename Key, typename Val>
-uint32_t bz_node<Key, Val>::binary_search(const Key * key, int size, uint64_t * meta_arr)
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::binary_search(const Key * key, int size, uint64_t * meta_arr)
 {
 	if (!size) {
 		size = (int)get_sorted_count(length_);
 	}
+	int left = -1, right = size;
+	if (key && !meta_arr && prefix_off_ && size && !is_leaf(length_))
+		return inner_search(key, (uint32_t)size);
+	/* narrow down on the key prefixes, the payload is only read to break ties */
+	if (key && !meta_arr && prefix_off_ && (uint32_t)size <= get_sorted_count(length_)) {
+		const uint64_t * prefixes = (const uint64_t*)((char*)this + prefix_off_);
+		uint64_t key_prefix = bz_key_prefix<Key, Cmp>()(key);
+		left = (int)(std::lower_bound(prefixes, prefixes + size, key_prefix) - prefixes) - 1;
+		right = (int)(std::upper_bound(prefixes + left + 1, prefixes + size, key_prefix) - prefixes);
+	}
 	if (!meta_arr)
 		meta_arr = rec_meta_arr();
-	int left = -1, right = size;
 	while (left + 1 < right) {
 		int mid = left + (right - left) / 2;
 		uint64_t meta_rd = pmwcas_read(&meta_arr[mid]);
@@ -2285,9 +4390,41 @@ uint32_t bz_node<Key, Val>::binary_search(const Key * key, int size, uint64_t *
 	}
 	return right;
 }
+/*
+* binary_search for an inner node with key prefixes: inner nodes are never
+* modified once published, so there are no holes to probe around.
+* Branchless lower bound on the prefixes, then a binary search on the keys
+* of the run of equal prefixes
+*/
+template<typename Key, typename Val, typename Cmp>
+uint32_t bz_node<Key, Val, Cmp>::inner_search(const Key * key, uint32_t size)
+{
+	const uint64_t * prefixes = (const uint64_t*)((char*)this + prefix_off_);
+	uint64_t key_prefix = bz_key_prefix<Key, Cmp>()(key);
+	const uint64_t * base = prefixes;
+	for (uint32_t n = size; n > 1; ) {
+		uint32_t half = n / 2;
+		base = base[half] < key_prefix ? base + half : base;
+		n -= half;
+	}
+	uint32_t pos = (uint32_t)(base - prefixes) + (*base < key_prefix);
+	if (pos == size || prefixes[pos] != key_prefix)
+		return pos;
+	/* keys sharing the prefix: binary search on the full keys within their run */
+	uint32_t end = (uint32_t)(std::upper_bound(prefixes + pos, prefixes + size, key_prefix) - prefixes);
+	uint64_t * meta_arr = rec_meta_arr();
+	while (pos < end) {
+		uint32_t mid = pos + (end - pos) / 2;
+		if (key_cmp(meta_arr[mid], key) < 0)
+			pos = mid + 1;
+		else
+			end = mid;
+	}
+	return pos;
+}
 /* װpmwcasʹ */
-template<typename Key, typename Val>
-int bz_tree<Key, Val>::pack_pmwcas(std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn)
+template<typename Key, typename Val, typename Cmp>
+int bz_tree<Key, Val, Cmp>::pack_pmwcas(std::vector<std::tuple<rel_ptr<uint64_t>, uint64_t, uint64_t>> casn)
 {
 	mdesc_t mdesc = alloc_mdesc();
 	if (mdesc.is_null())
@@ -2299,74 +4436,256 @@ int bz_tree<Key, Val>::pack_pmwcas(std::vector<std::tuple<rel_ptr<uint64_t>, uin
 	return done ? 0 : EPMWCASFAIL;
 }
 
-template<typename Key, typename Val>
-uint64_t * bz_node<Key, Val>::rec_meta_arr() {
+template<typename Key, typename Val, typename Cmp>
+uint64_t * bz_node<Key, Val, Cmp>::rec_meta_arr() {
 	return (uint64_t*)((char*)this + sizeof(*this));
 }
 /* K-V getter and setter */
-template<typename Key, typename Val>
-Key * bz_node<Key, Val>::get_key(uint64_t meta) {
+template<typename Key, typename Val, typename Cmp>
+Key * bz_node<Key, Val, Cmp>::get_key(uint64_t meta) {
 	uint32_t off = get_offset(meta);
 	if (!is_visiable(meta) || !off)
 		return nullptr;
 	return (Key*)((char*)this + off);
 }
-template<typename Key, typename Val>
-void bz_node<Key, Val>::set_key(uint32_t offset, const Key *key) {
-	Key * addr = (Key *)((char *)this + offset);
-	copy_key(addr, key);
-}
-template<typename Key, typename Val>
-void bz_node<Key, Val>::copy_key(Key * dst, const Key * src) {
-	if (*(uint64_t*)src == BZ_KEY_MAX)
-		*(uint64_t*)dst = BZ_KEY_MAX;
-	else if (typeid(Key) == typeid(char))
-		strcpy_s((char *)dst, strlen((char*)src) + 1, (char*)src);
+/* the sizes come from the caller or the meta entry, keys and values are never rescanned */
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::set_key(uint32_t offset, const Key *key, uint32_t key_size) {
+	char * addr = (char *)this + offset;
+	if (bz_codec<Key>::is_max(key))
+		bz_set_key_max(addr);
 	else
-		*dst = *src;
+		memcpy(addr, (const void*)key, key_size);
 }
-template<typename Key, typename Val>
-Val * bz_node<Key, Val>::get_value(uint64_t meta) {
+template<typename Key, typename Val, typename Cmp>
+Val * bz_node<Key, Val, Cmp>::get_value(uint64_t meta) {
 	return (Val*)((char*)this + get_offset(meta) + get_key_length(meta));
 }
-template<typename Key, typename Val>
-void bz_node<Key, Val>::set_value(uint32_t offset, const Val * val) {
-	Val * addr = (Val *)((char *)this + offset);
-	copy_value(addr, val);
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::set_value(uint32_t offset, const Val * val, uint32_t val_size) {
+	memcpy((char *)this + offset, (const void*)val, val_size);
 }
-template<typename Key, typename Val>
-void bz_node<Key, Val>::copy_value(Val * dst, const Val * src)
+/* the value of @param meta as a PMwCAS target: 8 bytes and aligned, nullptr otherwise */
+template<typename Key, typename Val, typename Cmp>
+inline uint64_t * bz_node<Key, Val, Cmp>::value_word(uint64_t meta)
+{
+#ifdef BZ_INPLACE_VALUE
+	if (sizeof(Val) == sizeof(uint64_t) && get_total_length(meta) - get_key_length(meta) == sizeof(uint64_t)) {
+		uint64_t * word = (uint64_t*)get_value(meta);
+		if (!((uintptr_t)word & (sizeof(uint64_t) - 1)))
+			return word;
+	}
+#endif // BZ_INPLACE_VALUE
+	return nullptr;
+}
+/* copy out a value that may be the target of an in-place update */
+template<typename Key, typename Val, typename Cmp>
+inline void bz_node<Key, Val, Cmp>::read_value(Val * dst, uint64_t meta)
 {
-	if (typeid(Val) == typeid(char))
-		strcpy((char*)dst, (const char*)src);
+	uint64_t * word = value_word(meta);
+	if (word)
+		*(uint64_t*)dst = pmwcas_read(word);
 	else
-		*dst = *src;
+		memcpy((void*)dst, (const void*)get_value(meta), get_total_length(meta) - get_key_length(meta));
+}
+/*
+* version of the record at @param pos: its meta entry address and the node
+* generation. Meta entries are never reused within a node and a recycled
+* node gets a new generation, so any write that replaces the record (or an
+* SMO that moves it) changes the version.
+* In-place value writes (BZ_INPLACE_VALUE) keep the record, hence the version:
+* the *_if_version calls refuse to run there
+*/
+template<typename Key, typename Val, typename Cmp>
+inline uint64_t bz_node<Key, Val, Cmp>::record_version(uint32_t pos)
+{
+	return ((uint64_t)get_node_gen(length_) << 48) | rel_ptr<uint64_t>(rec_meta_arr() + pos).rel();
 }
 /* ֵȽϺ */
-template<typename Key, typename Val>
-int bz_node<Key, Val>::key_cmp(uint64_t meta_entry, const Key * key) {
-	const Key * k1 = get_key(meta_entry);
-	if (*(uint64_t*)k1 == BZ_KEY_MAX)
-		return 1;
-	if (*(uint64_t*)key == BZ_KEY_MAX)
-		return -1;
-	if (typeid(Key) == typeid(char))
-		return strcmp((char*)k1, (char*)key);
-	if (*k1 == *key)
-		return 0;
-	return *k1 < *key ? -1 : 1;
+template<typename Key, typename Val, typename Cmp>
+int bz_node<Key, Val, Cmp>::key_cmp(uint64_t meta_entry, const Key * key) {
+	if (key_stripped(meta_entry)) {
+		if (bz_codec<Key>::is_max(key))
+			return -1;
+		return -bz_prefix_codec<Key>::compare(key, split_key(meta_entry));
+	}
+	return bz_key_compare<Key, Cmp>()(get_key(meta_entry), key);
 }
-template<typename Key, typename Val>
-bool bz_node<Key, Val>::key_cmp_meta(uint64_t meta_1, uint64_t meta_2)
+/* two stripped keys share the node prefix, their rests compare alone */
+template<typename Key, typename Val, typename Cmp>
+bool bz_node<Key, Val, Cmp>::key_cmp_meta(uint64_t meta_1, uint64_t meta_2)
 {
 	if (!is_visiable(meta_1))
 		return false;
 	if (!is_visiable(meta_2))
 		return true;
+	if (key_stripped(meta_2)) {
+		if (key_stripped(meta_1))
+			return Cmp::compare(get_key(meta_1), get_key(meta_2)) < 0;
+		return key_cmp(meta_2, get_key(meta_1)) > 0;
+	}
 	const Key * k2 = get_key(meta_2);
 	return key_cmp(meta_1, k2) < 0;
 }
 
+/* the key of the visible @param meta is stored without the node prefix */
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_node<Key, Val, Cmp>::key_stripped(uint64_t meta)
+{
+	return compress_keys && cpfx_len_ && get_offset(meta) >= cpfx_off_;
+}
+template<typename Key, typename Val, typename Cmp>
+inline const uint8_t * bz_node<Key, Val, Cmp>::key_prefix()
+{
+	return (const uint8_t*)this + get_node_size(length_) - cpfx_len_;
+}
+template<typename Key, typename Val, typename Cmp>
+inline bz_split_key bz_node<Key, Val, Cmp>::split_key(uint64_t meta)
+{
+	return bz_prefix_codec<Key>::split(key_prefix(), key_stripped(meta) ? cpfx_len_ : 0, get_key(meta));
+}
+template<typename Key, typename Val, typename Cmp>
+inline uint32_t bz_node<Key, Val, Cmp>::full_key_length(uint64_t meta)
+{
+	return get_key_length(meta) + (key_stripped(meta) ? cpfx_len_ : 0);
+}
+/* the key of @param meta in full: in place, or rebuilt in @param buf (padded for the BZ_KEY_MAX check) */
+template<typename Key, typename Val, typename Cmp>
+const Key * bz_node<Key, Val, Cmp>::full_key(uint64_t meta, std::string & buf)
+{
+	if (!key_stripped(meta))
+		return get_key(meta);
+	uint32_t key_sz = full_key_length(meta);
+	buf.assign(std::max<uint32_t>(key_sz, sizeof(uint64_t)), 0);
+	bz_prefix_codec<Key>::restrip((Key*)&buf[0], split_key(meta), 0);
+	return (const Key*)buf.data();
+}
+/* the key of @param meta starts with @param pfx[0, @param p) */
+template<typename Key, typename Val, typename Cmp>
+inline bool bz_node<Key, Val, Cmp>::shares_prefix(uint64_t meta, const uint8_t * pfx, uint32_t p)
+{
+	return split_key(meta).lcp(pfx, p) == p;
+}
+/*
+* narrow @param pfx down to the common prefix of the visible keys of @param metas[0, @param n),
+* @param found: pfx holds a key yet. With @param stripped_only, the keys stored without
+* the node prefix only: a prefix they share keeps them stripped, a copy never grows.
+* Leaves only, no-op when the keys are not compressed
+*/
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::common_key_prefix(const uint64_t * metas, uint32_t n, bool stripped_only, std::string & pfx, bool & found)
+{
+	if (!compress_keys || !is_leaf(length_))
+		return;
+	for (uint32_t i = 0; i < n; ++i) {
+		uint64_t meta_rd = pmwcas_read((uint64_t*)&metas[i]);
+		if (!is_visiable(meta_rd) || (stripped_only && !key_stripped(meta_rd)))
+			continue;
+		bz_split_key k = split_key(meta_rd);
+		if (!found) {
+			pfx.resize(k.size());
+			k.copy((uint8_t*)&pfx[0], 0);
+			found = true;
+		}
+		else {
+			pfx.resize(k.lcp((const uint8_t*)pfx.data(), (uint32_t)pfx.size()));
+		}
+	}
+}
+/*
+* prefix of a new leaf made of the records of @param srcs (node, meta entries, count):
+* the one of the stripped keys, or of all the keys when none is stripped
+*/
+template<typename Key, typename Val, typename Cmp>
+std::string bz_node<Key, Val, Cmp>::pick_key_prefix(std::initializer_list<std::tuple<bz_node *, const uint64_t *, uint32_t>> srcs)
+{
+	std::string pfx;
+	bool found = false;
+	for (bool stripped_only : { true, false }) {
+		for (auto & src : srcs)
+			std::get<0>(src)->common_key_prefix(std::get<1>(src), std::get<2>(src), stripped_only, pfx, found);
+		if (found)
+			break;
+	}
+	return pfx;
+}
+/*
+* separator K posted for a split between the last left key @param meta_lo of this node and
+* the first right key @param meta_hi of @param hi, @param key_sz its size: for a leaf the
+* shortest key in [left, right), else the left key in full (it bounds the left inner node)
+*/
+template<typename Key, typename Val, typename Cmp>
+const Key * bz_node<Key, Val, Cmp>::separator_key(uint64_t meta_lo, rel_ptr<bz_node<Key, Val, Cmp>> hi, uint64_t meta_hi, std::string & buf, uint32_t & key_sz)
+{
+	if (!truncate_separators || !is_leaf(length_)) {
+		key_sz = full_key_length(meta_lo);
+		return full_key(meta_lo, buf);
+	}
+	buf.assign(std::max<uint32_t>(full_key_length(meta_lo), sizeof(uint64_t)), 0);
+	key_sz = bz_prefix_codec<Key>::separator((Key*)&buf[0], split_key(meta_lo), hi->split_key(meta_hi));
+	return (const Key*)buf.data();
+}
+/* store @param pfx at the end of a new node, the records copied next may be stripped of it */
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::fr_set_prefix(const std::string & pfx)
+{
+	cpfx_off_ = 0;
+	cpfx_len_ = (uint32_t)pfx.size();
+	if (!cpfx_len_)
+		return;
+	memcpy((char*)this + get_node_size(length_) - cpfx_len_, pfx.data(), cpfx_len_);
+	set_block_size(status_, get_block_size(status_) + cpfx_len_);
+}
+/* the stripped records are in, the ones copied next are stored in full */
+template<typename Key, typename Val, typename Cmp>
+void bz_node<Key, Val, Cmp>::fr_close_prefix()
+{
+	if (!cpfx_len_)
+		return;
+	uint32_t blk_sz = get_block_size(status_);
+	if (blk_sz == cpfx_len_) {
+		set_block_size(status_, 0);
+		cpfx_len_ = 0;
+		return;
+	}
+	cpfx_off_ = get_node_size(length_) - blk_sz;
+}
+/*
+* copy the visible record @param meta_rd into @param dst, right below its first @param blk_sz
+* block bytes, stripped of the dst prefix with @param strip; @return its meta entry in dst
+*/
+template<typename Key, typename Val, typename Cmp>
+uint64_t bz_node<Key, Val, Cmp>::copy_record_to(rel_ptr<bz_node<Key, Val, Cmp>> dst, uint64_t meta_rd, uint32_t blk_sz, bool strip)
+{
+	uint32_t key_sz = get_key_length(meta_rd);
+	uint32_t val_sz = get_total_length(meta_rd) - key_sz;
+	uint32_t node_sz = get_node_size(dst->length_);
+	uint64_t new_meta;
+	if (!strip && !key_stripped(meta_rd)) {
+		uint32_t offset = node_sz - blk_sz - key_sz - val_sz;
+		new_meta = meta_vis_off_klen_tlen(0, true, offset, key_sz, key_sz + val_sz);
+		dst->copy_data(offset, get_key(meta_rd), get_value(meta_rd), key_sz, key_sz + val_sz);
+	}
+	else {
+		uint32_t cut = strip ? dst->cpfx_len_ : 0;
+		uint32_t new_key_sz = full_key_length(meta_rd) - cut;
+		uint32_t offset = node_sz - blk_sz - new_key_sz - val_sz;
+		new_meta = meta_vis_off_klen_tlen(0, true, offset, new_key_sz, new_key_sz + val_sz);
+		bz_prefix_codec<Key>::restrip(dst->get_key(new_meta), split_key(meta_rd), cut);
+		dst->set_value(offset + new_key_sz, get_value(meta_rd), val_sz);
+		persist((char*)dst.abs() + offset, new_key_sz + val_sz);
+	}
+	/*
+	* word values (child pointers, in-place values) go through pmwcas_read:
+	* a PMwCAS committed right before the freeze may still hold the dirty bit
+	*/
+	if (!is_leaf(length_))
+		*(uint64_t*)dst->get_value(new_meta) = pmwcas_read((uint64_t*)get_value(meta_rd));
+	else if (value_word(meta_rd))
+		read_value(dst->get_value(new_meta), meta_rd);
+	return new_meta;
+}
+
 /* λ BEGIN */
 inline bool is_frozen(uint64_t status) {
 	return 1 & (status >> 60);
@@ -2405,10 +4724,16 @@ inline void set_leaf(uint64_t &length) {
 	length &= (~1ULL);
 }
 inline uint32_t get_node_size(uint64_t length) {
-	return length >> 32;
+	return 0xffff & (length >> 32);
 }
 inline void set_node_size(uint64_t &s, uint64_t new_node_size) {
-	s = (s & 0xffffffff) | (new_node_size << 32);
+	s = (s & 0xffff0000ffffffff) | (new_node_size << 32);
+}
+inline uint32_t get_node_gen(uint64_t length) {
+	return length >> 48;
+}
+inline void set_node_gen(uint64_t &s, uint64_t new_gen) {
+	s = (s & 0x0000ffffffffffff) | (new_gen << 48);
 }
 inline uint32_t get_sorted_count(uint64_t length) {
 	return (length >> 1) & 0x7fffffff;
@@ -9,9 +9,12 @@ typedef struct ebr_tls {
 	/*
 	* - A local epoch counter for each thread.
 	* - The epoch counter may have the "active" flag set.
+	* - Nesting depth of the critical path (e.g. a cursor
+	*   holding the epoch while the thread runs other operations).
 	* - Thread list entry (pointer).
 	*/
 	unsigned		local_epoch;
+	unsigned		depth;
 	struct ebr_tls *	next;
 } ebr_tls_t;
 
@@ -80,6 +83,10 @@ ebr_enter(ebr_t *ebr)
 {
 	assert(local_ebr);
 
+	/* Nested entrance: the epoch is already observed. */
+	if (local_ebr->depth++)
+		return;
+
 	/*
 	* Set the "active" flag and set the local epoch to global
 	* epoch (i.e. observe the global epoch).  Ensure that the
@@ -100,6 +107,11 @@ ebr_exit(ebr_t *ebr)
 	t = local_ebr;
 	assert(t != NULL);
 
+	/* Leave only the outermost critical path. */
+	assert(t->depth > 0);
+	if (--t->depth)
+		return;
+
 	/*
 	* Clear the "active" flag.  Must ensure that any stores in
 	* the critical path reach global visibility before that.
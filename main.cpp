@@ -41,6 +41,22 @@ int main() {
 		cout << "split and merge" << endl;
 		tcase.run(false, false, false, false, false, false, false, true, true, false, 0, 1, 1);
 	}
+	for (int i = 0; i < 0; ++i) {
+		performance_test<uint64_t> perf;
+		cout << "scan benchmark" << endl;
+		perf.scan();
+		cout << "multi-put benchmark" << endl;
+		perf.multi_put();
+		cout << "bulk-load benchmark" << endl;
+		for (int t = 1; t <= (int)thread::hardware_concurrency(); t *= 2)
+			perf.bulk_load(1000000, t);
+		cout << "update benchmark" << endl;
+		perf.update();
+#ifdef BZ_INPLACE_VALUE
+		cout << "fetch_add benchmark" << endl;
+		perf.fetch_add();
+#endif // BZ_INPLACE_VALUE
+	}
 	system("pause");
 	return 0;
 }
\ No newline at end of file
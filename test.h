@@ -8,13 +8,290 @@
 #include <string.h>
 #include <unordered_map>
 #include <atomic>
+#include <chrono>
+#include <random>
+#include <algorithm>
 #include "bztree.h"
 #include "bzerrno.h"
 using namespace std;
 
 template<typename T>
 struct performance_test {
+	struct pmem_layout
+	{
+		bz_tree<T, T> tree;
+	};
+
+	/* old leaf-level emission order: sorted region, then the unsorted tail, as stored */
+	void collect_raw(uint64_t ptr, vector<const T*> & res)
+	{
+		if (is_leaf_node(ptr)) {
+			rel_ptr<bz_node<T, T>> leaf(ptr);
+			uint64_t * meta_arr = leaf->rec_meta_arr();
+			uint32_t rec_cnt = get_record_count(pmwcas_read(&leaf->status_));
+			for (uint32_t i = 0; i < rec_cnt; ++i) {
+				uint64_t meta_rd = pmwcas_read(&meta_arr[i]);
+				if (is_visiable(meta_rd))
+					res.push_back(leaf->get_key(meta_rd));
+			}
+			return;
+		}
+		rel_ptr<bz_node<T, uint64_t>> node(ptr);
+		uint32_t child_cnt = get_record_count(pmwcas_read(&node->status_));
+		for (uint32_t i = 0; i < child_cnt; ++i)
+			collect_raw(pmwcas_read(node->nth_val(i)), res);
+	}
+
+	/* full scan throughput: merged in-leaf emission vs raw emission + caller sort */
+	void scan(int rec_cnt = 100000, int rounds = 20)
+	{
+		const char * fname = "perf.pool";
+		remove(fname);
+		PMEMobjpool * pop = pmemobj_createU(fname, "layout", PMEMOBJ_MIN_POOL * 200, 0666);
+		assert(pop);
+		auto top_oid = pmemobj_root(pop, sizeof(pmem_layout));
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->tree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+
+		vector<T> keys(rec_cnt);
+		for (int i = 0; i < rec_cnt; ++i)
+			keys[i] = (T)i;
+		shuffle(keys.begin(), keys.end(), mt19937(rec_cnt));
+		for (int i = 0; i < rec_cnt; ++i)
+			tree.insert(&keys[i], &keys[i], sizeof(T), 2 * sizeof(T));
+
+		/* both sides hand out pointers to the keys, ordered by the tree comparator */
+		auto less = [](const T * a, const T * b) { return bz_key_compare<T>()(a, b) < 0; };
+		vector<const T*> res;
+		res.reserve(rec_cnt);
+		T beg = 0;
+		auto t0 = chrono::high_resolution_clock::now();
+		for (int r = 0; r < rounds; ++r) {
+			res.clear();
+			bz_cursor<T, T> cursor(&tree);
+			for (cursor.seek(&beg); cursor.valid(); cursor.next())
+				res.push_back(cursor.key());
+		}
+		auto t1 = chrono::high_resolution_clock::now();
+		assert(res.size() == rec_cnt && is_sorted(res.begin(), res.end(), less));
+		for (int r = 0; r < rounds; ++r) {
+			res.clear();
+			tree.register_this();
+			tree.acquire_rd();
+			collect_raw(pmwcas_read(&tree.root_), res);
+			sort(res.begin(), res.end(), less);
+			tree.release();
+		}
+		auto t2 = chrono::high_resolution_clock::now();
+		assert(res.size() == rec_cnt);
+
+		double merged = chrono::duration<double>(t1 - t0).count();
+		double post_sort = chrono::duration<double>(t2 - t1).count();
+		cout << "scan " << rec_cnt << " records x " << rounds << endl;
+		cout << "merged emission: " << fixed << setprecision(2) << rec_cnt * rounds / merged / 1e6 << " Mrec/s" << endl;
+		cout << "raw + post sort: " << fixed << setprecision(2) << rec_cnt * rounds / post_sort / 1e6 << " Mrec/s" << endl;
+
+		tree.finish();
+		pmemobj_close(pop);
+	}
+
+	/*
+	* ingest throughput of multi_insert for growing batch sizes (1: plain insert)
+	* every round inserts its own key range into the same tree,
+	* as batches of neighbouring keys (e.g. time ordered ingest) in random batch order
+	*/
+	void multi_put(int rec_cnt = 100000, int concurrent = 1)
+	{
+		const char * fname = "perf.pool";
+		remove(fname);
+		PMEMobjpool * pop = pmemobj_createU(fname, "layout", PMEMOBJ_MIN_POOL * 400, 0666);
+		assert(pop);
+		auto top_oid = pmemobj_root(pop, sizeof(pmem_layout));
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->tree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+
+		int round = 0;
+		for (int batch : { 1, 4, 16, 64, 256 }) {
+			vector<int> chunks((rec_cnt + 255) / 256);
+			for (int i = 0; i < (int)chunks.size(); ++i)
+				chunks[i] = i;
+			shuffle(chunks.begin(), chunks.end(), mt19937(rec_cnt));
+			vector<T> keys;
+			for (int c : chunks)
+				for (int i = c * 256; i < (c + 1) * 256 && i < rec_cnt; ++i)
+					keys.push_back((T)(round * rec_cnt + i));
+			++round;
+
+			auto t0 = chrono::high_resolution_clock::now();
+			vector<thread> workers;
+			for (int t = 0; t < concurrent; ++t)
+				workers.emplace_back([&, t]() {
+					vector<bz_write_op<T, T>> ops;
+					for (int i = t * batch; i < rec_cnt; i += concurrent * batch) {
+						ops.clear();
+						for (int j = i; j < i + batch && j < rec_cnt; ++j)
+							ops.push_back({ &keys[j], &keys[j], sizeof(T), 2 * sizeof(T), -1 });
+						if (batch == 1)
+							ops[0].ret = tree.insert(ops[0].key, ops[0].val, ops[0].key_size, ops[0].total_size);
+						else
+							tree.multi_insert(ops.data(), (uint32_t)ops.size());
+						for (auto & op : ops)
+							assert(!op.ret);
+					}
+				});
+			for (auto & w : workers)
+				w.join();
+			auto t1 = chrono::high_resolution_clock::now();
+
+			double sec = chrono::duration<double>(t1 - t0).count();
+			cout << "batch " << setw(4) << batch << ": " << fixed << setprecision(2) << rec_cnt / sec / 1e6 << " Mops/s" << endl;
+		}
+		tree.finish();
+		pmemobj_close(pop);
+	}
+
+	/* @param rounds passes of update over @param rec_cnt records, see BZ_INPLACE_VALUE */
+	void update(int rec_cnt = 100000, int rounds = 10)
+	{
+		const char * fname = "perf.pool";
+		remove(fname);
+		PMEMobjpool * pop = pmemobj_createU(fname, "layout", PMEMOBJ_MIN_POOL * 400, 0666);
+		assert(pop);
+		auto top_oid = pmemobj_root(pop, sizeof(pmem_layout));
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->tree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+
+		vector<T> keys(rec_cnt);
+		vector<bz_write_op<T, T>> ops(rec_cnt);
+		for (int i = 0; i < rec_cnt; ++i) {
+			keys[i] = (T)i;
+			ops[i] = { &keys[i], &keys[i], sizeof(T), 2 * sizeof(T), -1 };
+		}
+		int ret = tree.bulk_load(ops.data(), (uint32_t)rec_cnt);
+		assert(!ret);
+
+		auto t0 = chrono::high_resolution_clock::now();
+		for (int r = 1; r <= rounds; ++r) {
+			for (int i = 0; i < rec_cnt; ++i) {
+				T val = keys[i] + r;
+				ret = tree.update(&keys[i], &val, sizeof(T), 2 * sizeof(T));
+				assert(!ret);
+			}
+		}
+		auto t1 = chrono::high_resolution_clock::now();
+
+		double sec = chrono::duration<double>(t1 - t0).count();
+		cout << "update: " << fixed << setprecision(2) << (double)rec_cnt * rounds / sec / 1e6 << " Mops/s" << endl;
+		tree.finish();
+		pmemobj_close(pop);
+	}
+
+	/* @param concurrent threads doing fetch_add on @param rec_cnt hot counters, needs BZ_INPLACE_VALUE */
+	void fetch_add(int rec_cnt = 16, int concurrent = 4, int op_cnt = 100000)
+	{
+		const char * fname = "perf.pool";
+		remove(fname);
+		PMEMobjpool * pop = pmemobj_createU(fname, "layout", PMEMOBJ_MIN_POOL * 400, 0666);
+		assert(pop);
+		auto top_oid = pmemobj_root(pop, sizeof(pmem_layout));
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->tree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+
+		vector<T> keys(rec_cnt);
+		T zero = 0;
+		for (int i = 0; i < rec_cnt; ++i) {
+			keys[i] = (T)i;
+			int ret = tree.insert(&keys[i], &zero, sizeof(T), 2 * sizeof(T));
+			assert(!ret);
+		}
+
+		auto t0 = chrono::high_resolution_clock::now();
+		vector<thread> workers;
+		for (int t = 0; t < concurrent; ++t)
+			workers.emplace_back([&, t]() {
+				mt19937 rng(t);
+				for (int i = 0; i < op_cnt; ++i) {
+					int ret = tree.fetch_add(&keys[rng() % rec_cnt], 1);
+					assert(!ret);
+				}
+			});
+		for (auto & w : workers)
+			w.join();
+		auto t1 = chrono::high_resolution_clock::now();
+
+		T sum = 0;
+		for (int i = 0; i < rec_cnt; ++i) {
+			T val;
+			tree.read(&keys[i], &val, sizeof(T));
+			sum += val;
+		}
+		assert(sum == (T)concurrent * op_cnt);
+		double sec = chrono::duration<double>(t1 - t0).count();
+		cout << "fetch_add: " << fixed << setprecision(2) << (double)concurrent * op_cnt / sec / 1e6 << " Mops/s" << endl;
+		tree.finish();
+		pmemobj_close(pop);
+	}
 
+	/* bulk_load of @param rec_cnt sorted records by @param threads against as many single inserts */
+	void bulk_load(int rec_cnt = 1000000, int threads = 1)
+	{
+		const char * fname = "perf.pool";
+		remove(fname);
+		PMEMobjpool * pop = pmemobj_createU(fname, "layout", PMEMOBJ_MIN_POOL * 400, 0666);
+		assert(pop);
+		auto top_oid = pmemobj_root(pop, sizeof(pmem_layout));
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->tree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+
+		vector<T> keys(2 * rec_cnt);
+		for (int i = 0; i < 2 * rec_cnt; ++i)
+			keys[i] = (T)i;
+		vector<bz_write_op<T, T>> ops(rec_cnt);
+		for (int i = 0; i < rec_cnt; ++i)
+			ops[i] = { &keys[i], &keys[i], sizeof(T), 2 * sizeof(T), -1 };
+
+		auto t0 = chrono::high_resolution_clock::now();
+		int ret = tree.bulk_load(ops.data(), (uint32_t)rec_cnt, BULK_LOAD_FILL, threads);
+		assert(!ret);
+		auto t1 = chrono::high_resolution_clock::now();
+		for (int i = rec_cnt; i < 2 * rec_cnt; ++i) {
+			ret = tree.insert(&keys[i], &keys[i], sizeof(T), 2 * sizeof(T));
+			assert(!ret);
+		}
+		auto t2 = chrono::high_resolution_clock::now();
+
+		for (int i = 0; i < 2 * rec_cnt; i += 997) {
+			T val;
+			ret = tree.read(&keys[i], &val, sizeof(T));
+			assert(!ret && val == keys[i]);
+		}
+		double load_sec = chrono::duration<double>(t1 - t0).count();
+		double insert_sec = chrono::duration<double>(t2 - t1).count();
+		cout << "bulk load (" << threads << " threads): " << fixed << setprecision(2) << rec_cnt / load_sec / 1e6 << " Mrec/s, "
+			<< "insert: " << rec_cnt / insert_sec / 1e6 << " Mrec/s" << endl;
+		tree.finish();
+		pmemobj_close(pop);
+	}
 };
 
 template<typename T>
@@ -23,6 +300,12 @@ struct unit_test {
 	struct pmem_layout
 	{
 		bz_tree<T, rel_ptr<T>> tree;
+		bz_tree<T, rel_ptr<T>, bz_reverse_order<T>> rtree;
+		bz_tree<bz_bytes, rel_ptr<T>> btree;
+		bz_tree<bz_bytes, rel_ptr<T>> htree;
+		bz_tree<T, rel_ptr<T>> ctree;
+		bz_tree<T, rel_ptr<T>> ltree;
+		bz_tree<T, rel_ptr<T>> ftree;
 		T data[10000 * 8];
 	};
 
@@ -59,7 +342,7 @@ struct unit_test {
 		bool consolidate, bool split, bool merge,
 		bool tree_insert, int rec_cnt) 
 	{
-		uint32_t key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)k) + 1 : sizeof(T);
+		uint32_t key_sz = bz_codec<T>::size(k);
 		rel_ptr < bz_node<T, rel_ptr<T>>> root(top_obj->tree.root_);
 		if (write) {
 			print_log("INSERT", k);
@@ -203,7 +486,7 @@ struct unit_test {
 		}
 		if (tree_insert) {
 			for (int i = 0; i < rec_cnt; ++i) {
-				key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)(k+i)) + 1 : sizeof(T);
+				key_sz = bz_codec<T>::size(k+i);
 				print_log("TREE_INSERT", k + i);
 				int ret = top_obj->tree.insert(k + i, v + i, key_sz, key_sz + 8);
 				print_log("TREE_INSERT", k + i, ret);
@@ -212,7 +495,7 @@ struct unit_test {
 			//top_obj->tree.print_tree();
 
 			for (int i = 0; i < rec_cnt / 2; ++i) {
-				key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)(k + i)) + 1 : sizeof(T);
+				key_sz = bz_codec<T>::size(k + i);
 				print_log("TREE_DELETE", k + i);
 				int ret = top_obj->tree.remove(k + i);
 				print_log("TREE_DELETE", k + i, ret);
@@ -222,7 +505,7 @@ struct unit_test {
 			//top_obj->tree.print_tree();
 			
 			for (int i = rec_cnt / 2; i < rec_cnt; ++i) {
-				key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)(k + i)) + 1 : sizeof(T);
+				key_sz = bz_codec<T>::size(k + i);
 				print_log("TREE_UPDATE", k + i);
 				int ret = top_obj->tree.update(k + i, v + i + 1, key_sz, key_sz + 8);
 				print_log("TREE_UPDATE", k + i, ret);
@@ -230,7 +513,7 @@ struct unit_test {
 			//top_obj->tree.print_tree();
 
 			for (int i = 0; i < rec_cnt; ++i) {
-				key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)(k + i)) + 1 : sizeof(T);
+				key_sz = bz_codec<T>::size(k + i);
 				print_log("TREE_UPSERT", k + i);
 				int ret = top_obj->tree.upsert(k + i, v + i + 2, key_sz, key_sz + 8);
 				print_log("TREE_UPSERT", k + i, ret);
@@ -238,7 +521,7 @@ struct unit_test {
 			//top_obj->tree.print_tree();
 
 			for (int i = 0; i < rec_cnt; ++i) {
-				key_sz = typeid(T) == typeid(char) ? (uint32_t)strlen((char*)(k + i)) + 1 : sizeof(T);
+				key_sz = bz_codec<T>::size(k + i);
 				print_log("TREE_READ", k + i);
 				rel_ptr<T> buffer;
 				int ret = top_obj->tree.read(k + i, &buffer, 8);
@@ -301,14 +584,841 @@ struct unit_test {
 	}
 	void range_scan(pmem_layout * top_obj, T * beg, T * end)
 	{
-		rel_ptr < bz_node<T, rel_ptr<T>>> root(top_obj->tree.root_);
-		auto res = root->range_scan(beg, end);
-		for (auto kv : res) {
+		bz_cursor<T, rel_ptr<T>> cursor(&top_obj->tree);
+		int view_cnt = 0;
+		for (cursor.seek(beg, end); cursor.valid(); cursor.next(), ++view_cnt) {
 			if (typeid(T) == typeid(char))
-				cout << kv.first.get() << " : " << (char*)(*kv.second.get()).abs() << endl;
+				cout << (char*)cursor.key() << " : " << (char*)(*cursor.value()).abs() << endl;
 			else
-				cout << dec << *kv.first << " : " << **kv.second << endl;
+				cout << dec << *cursor.key() << " : " << **cursor.value() << endl;
+		}
+		/* same range copied out through a small arena */
+		char arena[256];
+		uint32_t used, copy_cnt = 0;
+		cursor.seek(beg, end);
+		if (cursor.valid()) {
+			/* too small for one record: nothing copied, the size it needs reported */
+			const T * first = cursor.key();
+			assert(!cursor.fill(arena, sizeof(bz_scan_rec), used) && used > sizeof(bz_scan_rec));
+			assert(cursor.valid() && cursor.key() == first);
+		}
+		while (cursor.valid()) {
+			uint32_t cnt = cursor.fill(arena, sizeof(arena), used);
+			assert(cnt || used > sizeof(arena));
+			if (!cnt)
+				break;
+			const bz_scan_rec * rec = (const bz_scan_rec*)arena;
+			for (uint32_t i = 0; i < cnt; ++i, rec = rec->next())
+				assert(rec->total_size - rec->key_size == sizeof(rel_ptr<T>));
+			copy_cnt += cnt;
+		}
+		assert(copy_cnt == view_cnt);
+		/* and backwards: (beg, end] in descending order */
+		bz_cursor<T, rel_ptr<T>> rcursor(&top_obj->tree, true, true);
+		rcursor.seek(end, beg);
+		for (const T * prev = nullptr; rcursor.valid(); prev = rcursor.key(), rcursor.next())
+			assert(!prev || bz_key_compare<T>()(rcursor.key(), prev) < 0);
+	}
+	void multi_get(pmem_layout * top_obj, T ** keys, int n)
+	{
+		vector<rel_ptr<T>> vals(n), single(n);
+		vector<rel_ptr<T>*> bufs(n);
+		vector<int> rets(n);
+		for (int i = 0; i < n; ++i)
+			bufs[i] = &vals[i];
+		top_obj->tree.multi_get(keys, n, bufs.data(), sizeof(rel_ptr<T>), rets.data());
+		for (int i = 0; i < n; ++i) {
+			int ret = top_obj->tree.read(keys[i], &single[i], sizeof(rel_ptr<T>));
+			assert(ret == rets[i] && (ret || single[i] == vals[i]));
+		}
+	}
+	void compare_and_swap(pmem_layout * top_obj, T * key)
+	{
+		auto &tree = top_obj->tree;
+		rel_ptr<T> cur, expected;
+		int found = tree.read(key, &cur, sizeof(rel_ptr<T>));
+		expected = cur;
+		int ret = tree.compare_and_swap(key, &expected, &cur);
+#ifdef BZ_INPLACE_VALUE
+		assert(found ? ret == ENOTFOUND : !ret && expected == cur);
+		if (found)
+			return;
+		expected = rel_ptr<T>(cur.rel() + sizeof(uint64_t));
+		ret = tree.compare_and_swap(key, &expected, &cur);
+		assert(ret == EMISMATCH && expected == cur);
+#else
+		assert(ret == (found ? ENOTFOUND : EVALUE));
+#endif // BZ_INPLACE_VALUE
+	}
+	/* @param threads bump the value of @param key by fetch_add and by CAS loops, @param op_cnt each */
+	void atomic_counter(pmem_layout * top_obj, T * key, int threads, int op_cnt)
+	{
+		auto &tree = top_obj->tree;
+		rel_ptr<T> old_val, cur;
+		if (tree.read(key, &old_val, sizeof(old_val)))
+			return;
+#ifdef BZ_INPLACE_VALUE
+		vector<thread> workers;
+		for (int t = 0; t < threads; ++t)
+			workers.emplace_back([&, t]() {
+				rel_ptr<T> seen, expected, desired;
+				uint64_t last = 0;
+				for (int i = 0; i < op_cnt; ++i) {
+					if (t & 1) {
+						assert(!tree.read(key, &expected, sizeof(expected)));
+						do {
+							desired = rel_ptr<T>(expected.rel() + 1);
+						} while (tree.compare_and_swap(key, &expected, &desired) == EMISMATCH);
+						seen = expected;
+					}
+					else
+						assert(!tree.fetch_add(key, 1, &seen));
+					/* every thread sees the counter grow */
+					assert(seen.rel() >= last);
+					last = seen.rel() + 1;
+				}
+			});
+		for (auto & w : workers)
+			w.join();
+		assert(!tree.read(key, &cur, sizeof(cur)));
+		assert(cur.rel() == old_val.rel() + (uint64_t)threads * op_cnt);
+		uint32_t key_sz = bz_codec<T>::size(key);
+		assert(!tree.update(key, &old_val, key_sz, key_sz + sizeof(rel_ptr<T>)));
+#else
+		assert(tree.fetch_add(key, 1) == EVALUE);
+		assert(!tree.read(key, &cur, sizeof(cur)) && cur == old_val);
+#endif // BZ_INPLACE_VALUE
+	}
+	void control_bits(pmem_layout * top_obj, T * key)
+	{
+		/* an 8-byte value with a PMwCAS control bit reads as a descriptor in place: rejected there */
+		auto &tree = top_obj->tree;
+		uint32_t key_sz = bz_codec<T>::size(key);
+		uint32_t tot_sz = key_sz + sizeof(rel_ptr<T>);
+		rel_ptr<T> old_val, val;
+		assert(!tree.read(key, &old_val, sizeof(old_val)));
+		rel_ptr<T> bad((uint64_t)(MwCAS_BIT | 1));
+		bz_write_op<T, rel_ptr<T>> op = { key, &bad, key_sz, tot_sz, -1 };
+#ifdef BZ_INPLACE_VALUE
+		assert(tree.upsert(key, &bad, key_sz, tot_sz) == EVALUE);
+		assert(tree.update(key, &bad, key_sz, tot_sz) == EVALUE);
+		assert(!tree.multi_upsert(&op, 1) && op.ret == EVALUE);
+		assert(tree.atomic_upsert(&op, 1) == EVALUE);
+		assert(!tree.read(key, &val, sizeof(val)) && val == old_val);
+#else
+		assert(!tree.upsert(key, &bad, key_sz, tot_sz));
+		assert(!tree.read(key, &val, sizeof(val)) && val == bad);
+		assert(!tree.multi_upsert(&op, 1) && !op.ret);
+		assert(!tree.upsert(key, &old_val, key_sz, tot_sz));
+#endif // BZ_INPLACE_VALUE
+	}
+	void atomic_upsert(pmem_layout * top_obj, T ** keys, int n)
+	{
+		auto &tree = top_obj->tree;
+		vector<rel_ptr<T>> vals(n), swapped(n);
+		vector<bz_write_op<T, rel_ptr<T>>> ops(n);
+		for (int i = 0; i < n; ++i) {
+			uint32_t key_sz = bz_codec<T>::size(keys[i]);
+			tree.read(keys[i], &vals[i], sizeof(rel_ptr<T>));
+			ops[i] = { keys[i], &vals[n - 1 - i], key_sz, key_sz + (uint32_t)sizeof(rel_ptr<T>), -1 };
+		}
+		/* all the values reversed at once */
+		int ret = tree.atomic_upsert(ops.data(), n);
+		assert(!ret);
+		for (int i = 0; i < n; ++i) {
+			ret = tree.read(keys[i], &swapped[i], sizeof(rel_ptr<T>));
+			assert(!ret && swapped[i] == vals[n - 1 - i] && !ops[i].ret);
+		}
+		/* a key given twice: nothing is written */
+		ops[n - 1].key = ops[0].key;
+		ops[n - 1].key_size = ops[0].key_size;
+		ret = tree.atomic_upsert(ops.data(), n);
+		assert(ret == EUNIKEY);
+		for (int i = 0; i < n - 1; ++i) {
+			tree.read(keys[i], &swapped[i], sizeof(rel_ptr<T>));
+			assert(swapped[i] == vals[n - 1 - i]);
+		}
+		ret = tree.atomic_insert(ops.data(), 1);
+		assert(ret == EUNIKEY);
+	}
+	void bounds(pmem_layout * top_obj, T ** keys, int n)
+	{
+		auto &tree = top_obj->tree;
+		char key_buf[16];
+		rel_ptr<T> val;
+		for (int i = 0; i < n; ++i) {
+			/* against a cursor: ceil is the seek position, upper_bound the one after an equal key */
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			cursor.seek(keys[i]);
+			int ret = tree.lower_bound(keys[i], (T*)key_buf, sizeof(key_buf), &val, sizeof(rel_ptr<T>));
+			assert(cursor.valid() ? !ret && !bz_key_compare<T>()((T*)key_buf, cursor.key()) && val == *cursor.value() : ret == ENOTFOUND);
+			if (cursor.valid() && !bz_key_compare<T>()(cursor.key(), keys[i]))
+				cursor.next();
+			ret = tree.upper_bound(keys[i], (T*)key_buf, sizeof(key_buf), &val, sizeof(rel_ptr<T>));
+			assert(cursor.valid() ? !ret && !bz_key_compare<T>()((T*)key_buf, cursor.key()) : ret == ENOTFOUND);
+
+			bz_cursor<T, rel_ptr<T>> rcursor(&tree, true, true);
+			rcursor.seek(keys[i]);
+			ret = tree.floor(keys[i], (T*)key_buf, sizeof(key_buf), &val, sizeof(rel_ptr<T>));
+			assert(rcursor.valid() ? !ret && !bz_key_compare<T>()((T*)key_buf, rcursor.key()) : ret == ENOTFOUND);
+			if (rcursor.valid() && !bz_key_compare<T>()(rcursor.key(), keys[i]))
+				rcursor.next();
+			ret = tree.floor(keys[i], (T*)key_buf, sizeof(key_buf), &val, sizeof(rel_ptr<T>), false);
+			assert(rcursor.valid() ? !ret && bz_key_compare<T>()((T*)key_buf, keys[i]) < 0 : ret == ENOTFOUND);
+		}
+		assert(tree.ceil(keys[0], (T*)key_buf, 0, &val, sizeof(rel_ptr<T>)) == ENOSPACE
+			|| tree.ceil(keys[0], (T*)key_buf, 0, &val, sizeof(rel_ptr<T>)) == ENOTFOUND);
+	}
+	void range_remove(pmem_layout * top_obj, T * beg, T * end)
+	{
+		auto &tree = top_obj->tree;
+		/* keep the records of [beg, end) to put them back afterwards */
+		std::vector<std::pair<std::string, rel_ptr<T>>> saved;
+		{
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			for (cursor.seek(beg, end); cursor.valid(); cursor.next())
+				saved.emplace_back(std::string((const char*)cursor.key(), cursor.key_size()), *cursor.value());
+		}
+		assert(!tree.remove_range(beg, end));
+		{
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			cursor.seek(beg, end);
+			assert(!cursor.valid());
+		}
+		for (auto & rec : saved) {
+			uint32_t key_sz = (uint32_t)rec.first.size();
+			int ret = tree.insert((const T*)rec.first.data(), &rec.second, key_sz, key_sz + sizeof(rel_ptr<T>));
+			assert(!ret);
+		}
+	}
+	void key_prefix(T ** keys, int n)
+	{
+		/* a smaller prefix is a smaller key, the same key the same prefix */
+		bz_key_prefix<T> prefix;
+		for (int i = 0; i < n; ++i) {
+			assert(prefix((const T*)&BZ_KEY_MAX) >= prefix(keys[i]));
+			for (int j = 0; j < n; ++j) {
+				int cmp = bz_key_compare<T>()(keys[i], keys[j]);
+				assert(prefix(keys[i]) >= prefix(keys[j]) || cmp < 0);
+				assert(cmp || prefix(keys[i]) == prefix(keys[j]));
+			}
+		}
+	}
+	void inner_search(pmem_layout * top_obj, T ** keys, int n)
+	{
+		/* the prefix search of an inner node agrees with the plain one */
+		rel_ptr<bz_node<T, uint64_t>> root(top_obj->tree.root_);
+		if (is_leaf(root->length_) || !root->prefix_off_)
+			return;
+		uint32_t sorted_cnt = get_sorted_count(root->length_);
+		for (int i = 0; i < n; ++i)
+			assert(root->binary_search(keys[i]) == root->binary_search(keys[i], sorted_cnt, root->rec_meta_arr()));
+		assert(root->binary_search((const T*)&BZ_KEY_MAX) == sorted_cnt - 1);
+	}
+	void codecs()
+	{
+		/* the fixed-width binary codec orders big-endian bytes, its prefix agrees */
+		struct bin12 { uint8_t b[12]; };
+		typedef bz_codec<bin12> codec;
+		std::mt19937_64 rng(2020);
+		bin12 k[16];
+		for (auto & x : k)
+			for (auto & c : x.b)
+				c = (uint8_t)(rng() % 3);
+		for (auto & a : k) {
+			bin12 c;
+			codec::copy(&c, &a);
+			assert(!codec::compare(&c, &a) && codec::size(&a) == sizeof(bin12));
+			for (auto & b : k) {
+				int cmp = codec::compare(&a, &b);
+				assert(cmp == -codec::compare(&b, &a));
+				assert(codec::prefix(&a) >= codec::prefix(&b) || cmp < 0);
+			}
+		}
+		/* the sentinel is found at any alignment */
+		char buf[16] = { 0 };
+		bz_set_key_max(buf + 3);
+		assert(bz_is_key_max(buf + 3) && !bz_is_key_max(buf + 2));
+		assert(bz_codec<char>::size("abc") == 4);
+	}
+	void binary_keys()
+	{
+		/* zeros are data, a proper prefix sorts first, the prefix agrees with memcmp */
+		typedef bz_codec<bz_bytes> codec;
+		std::mt19937_64 rng(2020);
+		std::vector<std::string> raw(64);
+		std::vector<std::vector<char>> buf(raw.size());
+		for (size_t i = 0; i < raw.size(); ++i) {
+			raw[i].resize(rng() % 12);
+			for (auto & c : raw[i])
+				c = (char)(rng() % 3);
+			buf[i].resize(bz_bytes::size_of((uint32_t)raw[i].size()));
+			bz_bytes::make(buf[i].data(), raw[i].data(), (uint32_t)raw[i].size());
+		}
+		for (size_t i = 0; i < raw.size(); ++i) {
+			const bz_bytes * a = (const bz_bytes*)buf[i].data();
+			assert(codec::size(a) == buf[i].size() && !codec::is_max(a));
+			for (size_t j = 0; j < raw.size(); ++j) {
+				const bz_bytes * b = (const bz_bytes*)buf[j].data();
+				int cmp = codec::compare(a, b);
+				assert((cmp < 0) == (raw[i] < raw[j]) && (cmp > 0) == (raw[i] > raw[j]));
+				assert(codec::prefix(a) <= codec::prefix(b) || cmp > 0);
+			}
+		}
+		char k[16] = { 0 };
+		bz_set_key_max(k);
+		assert(codec::is_max(k));
+	}
+	void separator_keys()
+	{
+		/* lo <= S < hi, S no longer than lo, whatever part of the keys is a node prefix */
+		std::mt19937_64 rng(2020);
+		for (int t = 0; t < 2000; ++t) {
+			std::string lo(rng() % 12, 0), hi(rng() % 12, 0);
+			for (auto & c : lo)
+				c = (char)(rng() % 3);
+			for (auto & c : hi)
+				c = (char)(rng() % 3);
+			if (lo == hi)
+				continue;
+			if (hi < lo)
+				lo.swap(hi);
+			uint32_t lp = (uint32_t)(rng() % (lo.size() + 1)), hp = (uint32_t)(rng() % (hi.size() + 1));
+			bz_split_key lk{ (const uint8_t*)lo.data(), lp, (const uint8_t*)lo.data() + lp, (uint32_t)lo.size() - lp };
+			bz_split_key hk{ (const uint8_t*)hi.data(), hp, (const uint8_t*)hi.data() + hp, (uint32_t)hi.size() - hp };
+			std::vector<char> buf(bz_bytes::size_of((uint32_t)lo.size()));
+			bz_bytes * sep = (bz_bytes*)buf.data();
+			assert(bz_prefix_codec<bz_bytes>::separator(sep, lk, hk) == bz_bytes::size_of(sep->length()));
+			std::string S((const char*)sep->data(), sep->length());
+			assert(lo <= S && S < hi && S.size() <= lo.size());
+			assert(lo.compare(0, S.size(), S) == 0 || hi.compare(0, S.size(), S) == 0);
+		}
+		char sep[16];
+		bz_split_key lo{ (const uint8_t*)"tenant/", 7, (const uint8_t*)"apple", 5 };
+		bz_split_key hi{ (const uint8_t*)"tenant/", 7, (const uint8_t*)"apricot", 7 };
+		assert(bz_prefix_codec<char>::separator(sep, lo, hi) == 11 && !strcmp(sep, "tenant/apr"));
+	}
+	void orders(PMEMobjpool * pop, PMEMoid top_oid, T ** keys, rel_ptr<T> * vals, int n)
+	{
+		/* a descending tree: lookups, splits and scans all follow its order */
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->rtree;
+		typedef bz_key_compare<T, bz_reverse_order<T>> rcmp;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		for (int i = 0; i < n; ++i) {
+			uint32_t key_sz = bz_codec<T>::size(keys[i]);
+			int ret = tree.insert(keys[i], vals + i, key_sz, key_sz + sizeof(rel_ptr<T>));
+			assert(!ret);
+		}
+		rel_ptr<T> val;
+		const T * first = keys[0];
+		for (int i = 0; i < n; ++i) {
+			int ret = tree.read(keys[i], &val, sizeof(val));
+			assert(!ret && val == vals[i]);
+			if (rcmp()(keys[i], first) < 0)
+				first = keys[i];
+		}
+		{
+			bz_cursor<T, rel_ptr<T>, bz_reverse_order<T>> cursor(&tree);
+			int cnt = 0;
+			const T * prev = nullptr;
+			for (cursor.seek(first); cursor.valid(); prev = cursor.key(), cursor.next(), ++cnt)
+				assert(!prev || rcmp()(prev, cursor.key()) < 0);
+			assert(cnt == n);
+		}
+		tree.finish();
+	}
+	int compressed_leaves(uint64_t ptr)
+	{
+		/* the key prefix arrays sit 8-byte aligned after variable-size records */
+		if (is_leaf_node(ptr)) {
+			rel_ptr<bz_node<bz_bytes, rel_ptr<T>>> leaf(ptr);
+			assert(!((uintptr_t)leaf.abs() + leaf->prefix_off_ & (sizeof(uint64_t) - 1)));
+			return leaf->cpfx_len_ ? 1 : 0;
+		}
+		rel_ptr<bz_node<bz_bytes, uint64_t>> node(ptr);
+		assert(!((uintptr_t)node.abs() + node->prefix_off_ & (sizeof(uint64_t) - 1)));
+		int cnt = 0;
+		uint32_t rec_cnt = get_record_count(pmwcas_read(&node->status_));
+		for (uint32_t i = 0; i < rec_cnt; ++i)
+			cnt += compressed_leaves(pmwcas_read(node->nth_val(i)));
+		return cnt;
+	}
+	void hybrid(PMEMobjpool * pop, PMEMoid top_oid, rel_ptr<T> * vals, int n, int threads)
+	{
+		/*
+		* hybrid mode under concurrent upserts, removes and scans, with leaf SMOs
+		* racing on the DRAM index; the index is dropped once midway and rebuilt
+		*/
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->htree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid, true))
+			assert(0);
+		tree.recovery();
+		auto make_key = [](std::vector<char> & buf, int t, int i) {
+			char s[64];
+			int len = sprintf(s, "tenant-%04d/table-orders/%06d/t%d", i % 3, i, t);
+			buf.resize(bz_bytes::size_of((uint32_t)len));
+			bz_bytes::make(buf.data(), s, (uint32_t)len);
+			return (const bz_bytes*)buf.data();
+		};
+		std::vector<std::vector<int>> live(threads, std::vector<int>(n, -1));
+		std::vector<thread> workers;
+		for (int t = 0; t < threads; ++t) {
+			workers.emplace_back([&, t] {
+				std::mt19937 rng(t + 1);
+				std::vector<char> buf;
+				for (int j = 0; j < n * 4; ++j) {
+					int i = (int)(rng() % n);
+					const bz_bytes * k = make_key(buf, t, i);
+					if (rng() % 4 == 0) {
+						int ret = tree.remove(k);
+						assert(ret == (live[t][i] < 0 ? ENOTFOUND : 0));
+						live[t][i] = -1;
+					}
+					else {
+						int v = (int)(rng() % n);
+						int ret = tree.upsert(k, vals + v, k->size(), k->size() + sizeof(rel_ptr<T>));
+						assert(!ret);
+						live[t][i] = v;
+					}
+					if (t == 0 && j == n * 2) {
+						auto guard = tree.lock_dram_index();
+						tree.dram_->invalidate();
+					}
+					if (j % 997 == 0) {
+						bz_cursor<bz_bytes, rel_ptr<T>> cursor(&tree);
+						char z[sizeof(uint64_t)] = { 0 };
+						std::string prev;
+						for (cursor.seek((const bz_bytes*)z); cursor.valid(); cursor.next()) {
+							const bz_bytes * key = cursor.key();
+							std::string cur((const char*)key->data(), key->length());
+							assert(prev.empty() || prev < cur);
+							prev.swap(cur);
+						}
+					}
+				}
+			});
+		}
+		for (auto & w : workers)
+			w.join();
+		assert(!tree.dram_->stale());
+		std::vector<char> buf;
+		int cnt = 0;
+		rel_ptr<T> val;
+		for (int t = 0; t < threads; ++t) {
+			for (int i = 0; i < n; ++i) {
+				int ret = tree.read(make_key(buf, t, i), &val, sizeof(val));
+				assert(live[t][i] < 0 ? ret == ENOTFOUND : !ret && val == vals[live[t][i]]);
+				cnt += live[t][i] >= 0;
+			}
+		}
+		{
+			bz_cursor<bz_bytes, rel_ptr<T>> cursor(&tree);
+			char z[sizeof(uint64_t)] = { 0 };
+			for (cursor.seek((const bz_bytes*)z); cursor.valid(); cursor.next())
+				--cnt;
+			assert(!cnt);
+		}
+		tree.finish();
+	}
+	void fingerprints(PMEMobjpool * pop, PMEMoid top_oid, T ** keys, rel_ptr<T> * vals, int n)
+	{
+		/*
+		* one leaf, all of it unsorted: keys sharing a fingerprint below and past
+		* the NODE_FINGERPRINTS slots, a slot whose fingerprint is not written yet
+		*/
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->ftree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		bz_key_fingerprint<T> fingerprint;
+		std::vector<std::vector<T*>> buckets(256);
+		for (int i = 0; i < n; ++i)
+			buckets[fingerprint(keys[i])].push_back(keys[i]);
+		int fp = 0;
+		for (int i = 1; i < 256; ++i)
+			if (buckets[i].size() > buckets[fp].size())
+				fp = i;
+		std::vector<T*> & coll = buckets[fp];
+		assert(coll.size() >= 3);
+		/* colliding keys, NODE_FINGERPRINTS others, the rest of the colliding ones; the last one never goes in */
+		std::vector<T*> order(coll.begin(), coll.begin() + coll.size() / 2);
+		for (int i = 0; i < n && order.size() < coll.size() / 2 + NODE_FINGERPRINTS; ++i)
+			if (fingerprint(keys[i]) != fp)
+				order.push_back(keys[i]);
+		order.insert(order.end(), coll.begin() + coll.size() / 2, coll.end() - 1);
+
+		uint32_t cnt = 0;
+		for (T * key : order) {
+			uint32_t key_sz = bz_codec<T>::size(key);
+			rel_ptr<bz_node<T, rel_ptr<T>>> root(tree.root_);
+			/* stop before the leaf consolidates, small nodes (BZ_TEST) hold few */
+			if (!root.is_null() && (get_sorted_count(root->length_) || root->triger_consolidate()))
+				break;
+			int ret = tree.insert(key, vals + cnt, key_sz, key_sz + sizeof(rel_ptr<T>));
+			assert(!ret);
+			++cnt;
+		}
+		rel_ptr<bz_node<T, rel_ptr<T>>> root(tree.root_);
+		assert(is_leaf(root->length_));
+		uint32_t sorted_cnt = get_sorted_count(root->length_);
+#ifndef BZ_TEST
+		assert(!sorted_cnt && cnt == order.size() && cnt > NODE_FINGERPRINTS);
+#endif // !BZ_TEST
+		rel_ptr<T> val;
+		for (uint32_t i = 0; i < cnt; ++i) {
+			int ret = tree.read(order[i], &val, sizeof(val));
+			assert(!ret && val == vals[i]);
+			uint32_t key_sz = bz_codec<T>::size(order[i]);
+			assert(tree.insert(order[i], &val, key_sz, key_sz + sizeof(rel_ptr<T>)) == EUNIKEY);
+		}
+		assert(tree.read(coll.back(), &val, sizeof(val)) == ENOTFOUND);
+
+		/* an unwritten fingerprint (0) never hides its slot */
+		uint32_t pos;
+		bool retry = false;
+		assert(root->find_key_unsorted(order[0], pmwcas_read(&root->status_), 0, pos, retry) && pos >= sorted_cnt);
+		if (pos - sorted_cnt < NODE_FINGERPRINTS) {
+			uint8_t saved = root->fingerprints_[pos - sorted_cnt];
+			root->fingerprints_[pos - sorted_cnt] = 0;
+			assert(!tree.read(order[0], &val, sizeof(val)) && val == vals[0]);
+			root->fingerprints_[pos - sorted_cnt] = saved;
+		}
+		tree.finish();
+	}
+	/* nodes in the free cache of @param tree, see bz_memory_pool */
+	uint32_t cached_nodes(bz_tree<T, rel_ptr<T>> & tree)
+	{
+#ifdef IS_PMEM
+		auto & mem = tree.pool_.mem_;
+		return (mem.back_ + MAX_ALLOC_NUM - mem.front_) % MAX_ALLOC_NUM;
+#else
+		return 0;
+#endif // IS_PMEM
+	}
+	/*
+	* @param ops rejected with @param expect by bulk_load, twice: the second load
+	* takes its nodes from the cache the first one returned them to
+	*/
+	void bulk_reject(bz_tree<T, rel_ptr<T>> & tree, const std::vector<bz_write_op<T, rel_ptr<T>>> & ops, int threads, int expect)
+	{
+		uint32_t before = cached_nodes(tree);
+		int ret = tree.bulk_load(ops.data(), (uint32_t)ops.size(), BULK_LOAD_FILL, threads);
+		assert(ret == expect);
+		uint32_t after = cached_nodes(tree);
+		assert(after >= before);
+		ret = tree.bulk_load(ops.data(), (uint32_t)ops.size(), BULK_LOAD_FILL, threads);
+		assert(ret == expect && cached_nodes(tree) == after);
+	}
+	void bulk_loads(PMEMobjpool * pop, PMEMoid top_oid, T ** keys, rel_ptr<T> * vals, int n)
+	{
+		/* bad input is rejected without leaking nodes, a loaded tree reads, scans and takes writes */
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->ltree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		std::vector<T*> sorted(keys, keys + n);
+		std::sort(sorted.begin(), sorted.end(), [](T * a, T * b) { return bz_key_compare<T>()(a, b) < 0; });
+		std::vector<bz_write_op<T, rel_ptr<T>>> ops(n);
+		for (int i = 0; i < n; ++i) {
+			uint32_t key_sz = bz_codec<T>::size(sorted[i]);
+			ops[i] = { sorted[i], vals + i, key_sz, key_sz + sizeof(rel_ptr<T>), -1 };
+		}
+
+		assert(tree.bulk_load(ops.data(), n, 0.f) == EVALUE);
+		assert(tree.bulk_load(ops.data(), n, 1.5f) == EVALUE);
+		auto bad = ops;
+		std::swap(bad[n / 2], bad[n / 2 + 1]);
+		bulk_reject(tree, bad, 1, EUNSORTED);
+		bad = ops;
+		bad[n / 2 + 1].key = bad[n / 2].key;
+		bulk_reject(tree, bad, 1, EUNIKEY);
+#ifdef BZ_INPLACE_VALUE
+		rel_ptr<T> ctrl((uint64_t)(MwCAS_BIT | 1));
+		bad = ops;
+		bad[n - 1].val = &ctrl;
+		assert(tree.bulk_load(bad.data(), n) == EVALUE);
+#endif // BZ_INPLACE_VALUE
+		assert(!tree.root_);
+
+		int ret = tree.bulk_load(ops.data(), n);
+		assert(!ret);
+		rel_ptr<T> val;
+		for (int i = 0; i < n; ++i) {
+			ret = tree.read(sorted[i], &val, sizeof(val));
+			assert(!ret && val == vals[i]);
+		}
+		/* the loaded leaves take removes, inserts and the SMOs they bring */
+		for (int i = 0; i < n; i += 2)
+			assert(!tree.remove(sorted[i]));
+		for (int i = 0; i < n; i += 2)
+			assert(!tree.insert(sorted[i], vals + n - 1 - i, ops[i].key_size, ops[i].total_size));
+		{
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			int cnt = 0;
+			for (cursor.seek(sorted[0]); cursor.valid(); cursor.next(), ++cnt) {
+				assert(!bz_key_compare<T>()(cursor.key(), sorted[cnt]));
+				ret = tree.read(sorted[cnt], &val, sizeof(val));
+				assert(!ret && val == vals[cnt % 2 ? cnt : n - 1 - cnt]);
+			}
+			assert(cnt == n);
+		}
+		bulk_reject(tree, ops, 1, ERACE);
+		tree.finish();
+	}
+	void parallel_bulk_load(PMEMobjpool * pop, PMEMoid top_oid, T ** keys, rel_ptr<T> * vals, int n, int threads)
+	{
+		/* leaves built by @param threads: the order is checked across their cuts too */
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->ltree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		std::vector<T*> sorted(keys, keys + n);
+		std::sort(sorted.begin(), sorted.end(), [](T * a, T * b) { return bz_key_compare<T>()(a, b) < 0; });
+		std::vector<bz_write_op<T, rel_ptr<T>>> ops(n);
+		for (int i = 0; i < n; ++i) {
+			uint32_t key_sz = bz_codec<T>::size(sorted[i]);
+			ops[i] = { sorted[i], vals + i, key_sz, key_sz + sizeof(rel_ptr<T>), -1 };
+		}
+
+		/* each range sorted on its own, the fault only at a cut */
+		int cut = (int)((uint64_t)n * (threads - 1) / threads);
+		auto bad = ops;
+		std::swap(bad[cut - 1], bad[cut]);
+		bulk_reject(tree, bad, threads, EUNSORTED);
+		bad = ops;
+		bad[cut].key = bad[cut - 1].key;
+		bulk_reject(tree, bad, threads, EUNIKEY);
+		assert(!tree.root_);
+
+		int ret = tree.bulk_load(ops.data(), n, BULK_LOAD_FILL, threads);
+		assert(!ret);
+		rel_ptr<T> val;
+		for (int i = 0; i < n; ++i) {
+			ret = tree.read(sorted[i], &val, sizeof(val));
+			assert(!ret && val == vals[i]);
+		}
+		{
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			int cnt = 0;
+			for (cursor.seek(sorted[0]); cursor.valid(); cursor.next(), ++cnt)
+				assert(!bz_key_compare<T>()(cursor.key(), sorted[cnt]));
+			assert(cnt == n);
+		}
+		bulk_reject(tree, ops, threads, ERACE);
+		tree.finish();
+	}
+	void concurrent_range_remove(PMEMobjpool * pop, PMEMoid top_oid, T ** keys, rel_ptr<T> * vals, int n, int threads)
+	{
+		/*
+		* remove_range unlinking leaves again and again while @param threads upsert
+		* the keys around the range: their leaves consolidate and split under the
+		* parents being copied
+		*/
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->ctree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		std::vector<T*> sorted(keys, keys + n);
+		std::sort(sorted.begin(), sorted.end(), [](T * a, T * b) { return bz_key_compare<T>()(a, b) < 0; });
+		auto put = [&](int i, int v) {
+			uint32_t key_sz = bz_codec<T>::size(sorted[i]);
+			int ret = tree.upsert(sorted[i], vals + v, key_sz, key_sz + sizeof(rel_ptr<T>));
+			assert(!ret);
+		};
+		int lo = n / 4, hi = n * 3 / 4;
+		std::vector<int> last(n);
+		for (int i = 0; i < n; ++i)
+			put(i, last[i] = i);
+		std::vector<thread> workers;
+		workers.emplace_back([&] {
+			for (int round = 0; round < 5; ++round) {
+				if (round)
+					for (int i = lo; i < hi; ++i)
+						put(i, i);
+				int ret = tree.remove_range(sorted[lo], sorted[hi]);
+				assert(!ret);
+			}
+		});
+		for (int t = 0; t < threads; ++t)
+			workers.emplace_back([&, t] {
+				for (int pass = 1; pass <= 4; ++pass)
+					for (int i = t; i < n; i += threads)
+						if (i < lo || i >= hi)
+							put(i, last[i] = (i + pass) % n);
+			});
+		for (auto & w : workers)
+			w.join();
+		rel_ptr<T> val;
+		for (int i = 0; i < n; ++i) {
+			int ret = tree.read(sorted[i], &val, sizeof(val));
+			assert(i >= lo && i < hi ? ret == ENOTFOUND : !ret && val == vals[last[i]]);
+		}
+		{
+			bz_cursor<T, rel_ptr<T>> cursor(&tree);
+			int cnt = 0;
+			const T * prev = nullptr;
+			for (cursor.seek(sorted[0]); cursor.valid(); prev = cursor.key(), cursor.next(), ++cnt)
+				assert(!prev || bz_key_compare<T>()(prev, cursor.key()) < 0);
+			assert(cnt == n - (hi - lo));
+		}
+		tree.finish();
+	}
+	void compressed_keys(PMEMobjpool * pop, PMEMoid top_oid, rel_ptr<T> * vals, int n)
+	{
+		/* keys with a long common prefix: leaves store it once, reads and scans see the full keys */
+		auto top_obj = (pmem_layout *)pmemobj_direct(top_oid);
+		auto &tree = top_obj->btree;
+		tree.first_use(pop, top_oid);
+		if (tree.init(pop, top_oid))
+			assert(0);
+		tree.recovery();
+		std::vector<std::string> raw(n);
+		std::vector<std::vector<char>> buf(n);
+		for (int i = 0; i < n; ++i) {
+			char s[64];
+			int len = i % 10 ? sprintf(s, "tenant-0042/table-orders/%06d", i) : sprintf(s, "rogue-%d", i);
+			raw[i].assign(s, len);
+			buf[i].resize(bz_bytes::size_of((uint32_t)len));
+			bz_bytes::make(buf[i].data(), s, (uint32_t)len);
+		}
+		for (int i = 0; i < n; ++i) {
+			const bz_bytes * k = (const bz_bytes*)buf[i].data();
+			int ret = tree.insert(k, vals + i, k->size(), k->size() + sizeof(rel_ptr<T>));
+			assert(!ret);
+		}
+		std::vector<std::pair<std::string, int>> expect;
+		for (int i = 0; i < n; ++i) {
+			if (i % 7)
+				expect.emplace_back(raw[i], i);
+			else if (tree.remove((const bz_bytes*)buf[i].data()))
+				assert(0);
+		}
+		std::sort(expect.begin(), expect.end());
+		rel_ptr<T> val;
+		for (int i = 0; i < n; ++i) {
+			int ret = tree.read((const bz_bytes*)buf[i].data(), &val, sizeof(val));
+			assert(i % 7 ? !ret && val == vals[i] : ret == ENOTFOUND);
 		}
+		{
+			bz_cursor<bz_bytes, rel_ptr<T>> cursor(&tree);
+			char z[sizeof(uint64_t)] = { 0 };
+			auto it = expect.begin();
+			for (cursor.seek((const bz_bytes*)z); cursor.valid(); cursor.next(), ++it) {
+				const bz_bytes * k = cursor.key();
+				val = *cursor.value();
+				assert(it != expect.end() && cursor.key_size() == k->size());
+				assert(std::string((const char*)k->data(), k->length()) == it->first && val == vals[it->second]);
+			}
+			assert(it == expect.end());
+		}
+		tree.register_this();
+		tree.acquire_rd();
+		assert((!bz_node<bz_bytes, rel_ptr<T>>::compress_keys || compressed_leaves(pmwcas_read(&tree.root_)) > 0));
+		tree.release();
+		tree.finish();
+	}
+	void meta_runs()
+	{
+		/* any number of sorted runs, empty ones too, merge into the sorted whole */
+		std::mt19937_64 rng(2020);
+		for (int t = 0; t < 200; ++t) {
+			std::vector<uint64_t> arr;
+			std::vector<uint32_t> bounds(1, 0);
+			uint32_t k = 1 + (uint32_t)(rng() % 9);
+			for (uint32_t i = 0; i < k; ++i) {
+				size_t beg = arr.size();
+				arr.resize(beg + rng() % 40);
+				for (size_t j = beg; j < arr.size(); ++j)
+					arr[j] = rng() % 100;
+				std::sort(arr.begin() + beg, arr.end());
+				bounds.push_back((uint32_t)arr.size());
+			}
+			std::vector<uint64_t> expect(arr);
+			std::sort(expect.begin(), expect.end());
+			merge_meta_k_runs(arr.data(), bounds.data(), k, std::less<uint64_t>());
+			assert(arr == expect);
+		}
+	}
+	void meta_scan()
+	{
+		/* every kernel the cpu has agrees with the scalar loop, on all lengths */
+		std::mt19937_64 rng(2020);
+		uint32_t epoch = 0x1234;
+		uint64_t meta[BZ_META_SCAN_MAX];
+		for (auto & w : meta) {
+			switch (rng() % 5) {
+			case 0: w = rng() & ~BZ_META_VIS_MASK; break;
+			case 1: w = bz_meta_pending_word(epoch) | (rng() & 0xffffffff); break;
+			case 2: w = ((uint64_t)1 << 60) | (rng() & 0x0fffffff0000ffff); break;
+			case 3: w = rng() | ((uint64_t)1 << (61 + rng() % 3)); break;
+			default: w = 0;
+			}
+		}
+		std::vector<bz_meta_scan_fn> kernels = { bz_meta_scan };
+#ifdef BZ_SIMD_X86
+		if (__builtin_cpu_supports("avx2"))
+			kernels.push_back(bz_meta_scan_avx2);
+		if (__builtin_cpu_supports("avx512f"))
+			kernels.push_back(bz_meta_scan_avx512);
+#endif // BZ_SIMD_X86
+		for (uint32_t n = 0; n <= BZ_META_SCAN_MAX; ++n) {
+			bz_meta_masks ref, m;
+			bz_meta_scan_scalar(meta, n, epoch, ref);
+			for (auto scan : kernels) {
+				scan(meta, n, epoch, m);
+				assert(m.ctrl == ref.ctrl && m.visible == ref.visible && m.pending == ref.pending);
+			}
+			for (uint32_t i = 0; i < n; ++i) {
+				uint64_t bit = (uint64_t)1 << i;
+				assert(!!(ref.ctrl & bit) == !!(meta[i] & BZ_META_CTRL_MASK));
+				assert(!(ref.visible & bit) || is_visiable(meta[i]));
+				assert(!(ref.pending & bit) || get_offset(meta[i]) == epoch);
+			}
+		}
+	}
+	void versions(pmem_layout * top_obj, T * key)
+	{
+		auto &tree = top_obj->tree;
+		uint32_t key_sz = bz_codec<T>::size(key);
+		uint32_t tot_sz = key_sz + sizeof(rel_ptr<T>);
+		rel_ptr<T> cur;
+		uint64_t ver = 0, ver_new = 0;
+		int ret = tree.read(key, &cur, sizeof(rel_ptr<T>), &ver);
+#ifdef BZ_INPLACE_VALUE
+		/* fetch_add / compare_and_swap / in-place updates would not change the version */
+		assert(tree.update_if_version(key, &cur, key_sz, tot_sz, ver) == EVALUE);
+		assert(tree.remove_if_version(key, ver) == EVALUE);
+		return;
+#endif // BZ_INPLACE_VALUE
+		if (ret) {
+			assert(tree.update_if_version(key, &cur, key_sz, tot_sz, ver) == ENOTFOUND);
+			return;
+		}
+		/* the same value written back still makes a new version */
+		ret = tree.update_if_version(key, &cur, key_sz, tot_sz, ver);
+		assert(!ret);
+		ret = tree.read(key, &cur, sizeof(rel_ptr<T>), &ver_new);
+		assert(!ret && ver_new != ver);
+		assert(tree.update_if_version(key, &cur, key_sz, tot_sz, ver) == EMISMATCH);
+		assert(tree.remove_if_version(key, ver) == EMISMATCH);
+		ret = tree.remove_if_version(key, ver_new);
+		assert(!ret && tree.read(key, &cur, sizeof(rel_ptr<T>)) == ENOTFOUND);
+		ret = tree.insert(key, &cur, key_sz, tot_sz);
+		assert(!ret);
 	}
 	void run(
 		bool first = true,
@@ -324,7 +1434,8 @@ struct unit_test {
 		int rec_cnt = 10000,
 		int sz = 32,
 		int concurrent = 16,
-		bool recovery = true) 
+		bool recovery = true,
+		bool dram_inner = false) 
 	{
 		const char * fname = "test.pool";
 		PMEMobjpool * pop;
@@ -351,7 +1462,7 @@ struct unit_test {
 				else
 					top_obj->data[i] = 10 * i;
 		}
-		if (tree.init(pop, top_oid))
+		if (tree.init(pop, top_oid, dram_inner))
 			assert(0);
 		if (recovery) {
 			tree.recovery();
@@ -397,16 +1508,48 @@ struct unit_test {
 				range_scan(top_obj, (T*)char_keys[0], (T*)char_keys[9]);
 			else
 				range_scan(top_obj, &keys[0], &keys[63]);
+			T * key_ptrs[64];
+			for (int i = 0; i < 64; ++i)
+				key_ptrs[i] = typeid(T) == typeid(char) ? (T*)char_keys[63 - i] : &keys[63 - i];
+			multi_get(top_obj, key_ptrs, 64);
+			compare_and_swap(top_obj, key_ptrs[0]);
+			atomic_counter(top_obj, key_ptrs[3], 4, 2000);
+			control_bits(top_obj, key_ptrs[2]);
+			atomic_upsert(top_obj, key_ptrs, 4);
+			versions(top_obj, key_ptrs[1]);
+			bounds(top_obj, key_ptrs, 64);
+			range_remove(top_obj, key_ptrs[48], key_ptrs[16]);
+			key_prefix(key_ptrs, 64);
+			inner_search(top_obj, key_ptrs, 64);
+			codecs();
+			binary_keys();
+			separator_keys();
+			meta_scan();
+			meta_runs();
 		}
 		if (tree_insert) {
 			top_obj->tree.print_tree();
 		}
 
+		tree.finish();
+		if (!split) {
+			/* the second tree runs once the first one has stopped its G/C */
+			T * order_keys[2000];
+			for (int i = 0; i < 2000; ++i)
+				order_keys[i] = typeid(T) == typeid(char) ? (T*)char_keys[i] : &keys[i];
+			orders(pop, top_oid, order_keys, vals, 2000);
+			compressed_keys(pop, top_oid, vals, 2000);
+			hybrid(pop, top_oid, vals, 2000, 4);
+			concurrent_range_remove(pop, top_oid, order_keys, vals, 2000, 3);
+			bulk_loads(pop, top_oid, order_keys, vals, 2000);
+			parallel_bulk_load(pop, top_oid, order_keys, vals, 2000, 4);
+			fingerprints(pop, top_oid, order_keys, vals, 2000);
+		}
+
 		//չ
 		for (int i = 0; i < 10000; ++i) {
 			delete[] char_keys[i];
 		}
-		tree.finish();
 		pmemobj_close(pop);
 	}
 };
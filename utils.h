@@ -2,6 +2,7 @@
 #define UTILS_H
 #include <assert.h>
 #include <stdint.h>
+#include <vector>
 #include <libpmemobj.h>
 
 #define MAX_PATH_DEPTH	16
@@ -40,6 +41,45 @@ struct bz_path_stack
 	}
 };
 
+/*
+* merge two sorted runs of metas in place, back to front:
+* @param arr holds the first run in [0, n) and has room for @param m more,
+* @param tail is the second run, @param less orders the metas
+*/
+template<typename Less>
+inline void merge_meta_runs(uint64_t * arr, uint32_t n, const uint64_t * tail, uint32_t m, Less less)
+{
+	int i = (int)n - 1, j = (int)m - 1, k = (int)(n + m) - 1;
+	while (j >= 0) {
+		if (i >= 0 && less(tail[j], arr[i]))
+			arr[k--] = arr[i--];
+		else
+			arr[k--] = tail[j--];
+	}
+}
+
+/*
+* merge the sorted runs arr[@param bounds[i], bounds[i + 1]), i < @param k, into one,
+* pairwise in rounds: O(n log k) compares; bounds is overwritten
+*/
+template<typename Less>
+inline void merge_meta_k_runs(uint64_t * arr, uint32_t * bounds, uint32_t k, Less less)
+{
+	std::vector<uint64_t> tmp;
+	while (k > 1) {
+		uint32_t w = 0;
+		for (uint32_t i = 0; i < k; i += 2) {
+			if (i + 1 < k) {
+				tmp.assign(arr + bounds[i + 1], arr + bounds[i + 2]);
+				merge_meta_runs(arr + bounds[i], bounds[i + 1] - bounds[i], tmp.data(), (uint32_t)tmp.size(), less);
+			}
+			bounds[w++] = bounds[i];
+		}
+		bounds[w] = bounds[k];
+		k = w;
+	}
+}
+
 POBJ_LAYOUT_BEGIN(layout_name);
 POBJ_LAYOUT_TOID(layout_name, struct bz_node_block);
 POBJ_LAYOUT_END(layout_name);
@@ -139,10 +179,18 @@ struct bz_memory_pool {
 		if (ptr->is_null())
 			return;
 		pmemobj_mutex_lock(pop_, &mem_lock);
+		if ((back_ + 1) % MAX_ALLOC_NUM == front_) {
+			/* the cache is full, e.g. after an abandoned bulk load: back to pmemobj */
+			PMEMoid oid = ptr->oid();
+			*ptr = rel_ptr<uint64_t>();
+			pmem_persist(ptr.abs(), sizeof(uint64_t));
+			pmemobj_free(&oid);
+			pmemobj_mutex_unlock(pop_, &mem_lock);
+			return;
+		}
 		nodes[back_] = ptr->rel();
 		*ptr = rel_ptr<uint64_t>();
 		back_ = (back_ + 1) % MAX_ALLOC_NUM;
-		assert(back_ != front_);
 		pmem_persist(ptr.abs(), sizeof(uint64_t));
 		pmem_persist(&back_, sizeof(uint32_t));
 		pmemobj_mutex_unlock(pop_, &mem_lock);